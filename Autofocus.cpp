@@ -0,0 +1,319 @@
+#include "Autofocus.h"
+#include "AutofocusKernels.h"
+#include <fstream>
+#include <filesystem>
+
+Autofocus::Autofocus(const Settings& settings)
+    : settings(settings), regionHalo(AutofocusPyramid(settings.sigmas, settings.blurMode, settings.chainLevels()).haloRadius() + 1)
+{
+    CV_Assert(settings.sigmas.size() >= 2);
+    CV_Assert(settings.lastLevel >= 0 && settings.lastLevel <= (int)settings.sigmas.size() - 2);
+    CV_Assert(settings.outputType == CV_32FC2 || settings.outputType == CV_8UC3);
+    CV_Assert(settings.convergenceThreshold >= 0.0 && settings.minPasses >= 1);
+    CV_Assert(settings.engine == DiscreteLevels || settings.sigmas[settings.lastLevel] > 0.0f); // the analytic model needs a blurred last level
+}
+
+Autofocus::Worker* Autofocus::acquireWorker()
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (idleWorkers.empty())
+    {
+        workers.emplace_back(new Worker(settings));
+        return workers.back().get();
+    }
+
+    Worker* worker = idleWorkers.back();
+    idleWorkers.pop_back();
+    return worker;
+}
+
+void Autofocus::releaseWorker(Worker* worker)
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    idleWorkers.push_back(worker);
+}
+
+// allocates (and clears, the kernels never write the border) only if the field does not fit already
+void Autofocus::prepareField(const cv::Size& size, int type, cv::Mat& field)
+{
+    if (field.size() == size && field.type() == type)
+        return;
+
+    field.create(size, type);
+    field.setTo(cv::Scalar::all(0));
+    ClearDirectionMap(field); // region modes leave most of the interior alone
+}
+
+void Autofocus::processLevels(const std::vector<cv::Mat>& levels, int lastLevel, cv::Mat& field, bool parallel)
+{
+    CV_Assert(levels.size() >= 2 && lastLevel >= 0 && lastLevel <= (int)levels.size() - 2);
+    CV_Assert(field.type() == CV_32FC2 || field.type() == CV_8UC3);
+    prepareField(levels[0].size(), field.type(), field);
+
+    for (int level = (int)levels.size() - 2; level >= lastLevel; level--)
+    {
+        if (parallel)
+            GetStimuliParallel(levels[level + 1], levels[level], field);
+        else
+            GetStimuli(levels[level + 1], levels[level], field);
+    }
+}
+
+int Autofocus::processWith(Worker& worker, const cv::Mat& image, cv::Mat& field, bool parallel)
+{
+    if (worker.analytic)
+    {
+        prepareField(image.size(), settings.outputType, field);
+        worker.analytic->process(image, field);
+        return settings.lastLevel;
+    }
+
+    AutofocusPyramid& pyramid = worker.pyramid;
+    int top = pyramid.levelCount() - 1;
+    bool earlyTermination = settings.convergenceThreshold > 0.0;
+    bool lazyLevels = earlyTermination && !pyramid.isChained(); // levels are blurred right before their pass, see Settings
+
+    prepareField(image.size(), settings.outputType, field);
+    if (lazyLevels)
+    {
+        pyramid.start(image);
+        pyramid.buildLevel(top);
+    }
+    else
+        pyramid.build(image);
+
+    if (earlyTermination)
+    {
+        worker.directionCodes.create(image.size(), CV_8UC1);
+        worker.directionCodes.setTo(cv::Scalar(0));
+    }
+
+    int passes = 0;
+    for (int level = top - 1; level >= settings.lastLevel; level--)
+    {
+        if (lazyLevels)
+            pyramid.buildLevel(level);
+
+        if (parallel)
+            GetStimuliParallel(pyramid.getLevel(level + 1), pyramid.getLevel(level), field);
+        else
+            GetStimuli(pyramid.getLevel(level + 1), pyramid.getLevel(level), field);
+
+        passes++;
+        if (earlyTermination && UpdateDirectionCodes(field, worker.directionCodes) < settings.convergenceThreshold && passes >= settings.minPasses)
+            return level;
+    }
+    return settings.lastLevel;
+}
+
+int Autofocus::process(const cv::Mat& image, cv::Mat& field)
+{
+    WorkerLease worker(*this);
+    return processWith(*worker, image, field, true);
+}
+
+void Autofocus::processRegion(Worker& worker, const cv::Mat& image, const cv::Rect& region, cv::Mat& field, const cv::Mat* mask)
+{
+    // the 1 pixel frame border is never written, like in the full frame run
+    cv::Rect target = region & cv::Rect(1, 1, image.cols - 2, image.rows - 2);
+    if (target.empty())
+        return;
+
+    cv::Rect crop = cv::Rect(target.x - regionHalo, target.y - regionHalo, target.width + 2 * regionHalo, target.height + 2 * regionHalo) & cv::Rect(0, 0, image.cols, image.rows);
+
+    processWith(worker, image(crop), worker.regionField, true);
+
+    cv::Mat result = worker.regionField(target - crop.tl());
+    if (mask)
+        result.copyTo(field(target), (*mask)(target));
+    else
+        result.copyTo(field(target));
+}
+
+double Autofocus::regionCost(const std::vector<cv::Rect>& regions, const cv::Size& size) const
+{
+    // same crops as processRegion
+    cv::Rect frame(0, 0, size.width, size.height);
+    cv::Rect interior(1, 1, size.width - 2, size.height - 2);
+    double area = 0.0;
+    for (const cv::Rect& region : regions)
+    {
+        cv::Rect target = region & interior;
+        if (!target.empty())
+            area += (cv::Rect(target.x - regionHalo, target.y - regionHalo, target.width + 2 * regionHalo, target.height + 2 * regionHalo) & frame).area();
+    }
+    return frame.area() > 0 ? area / frame.area() : 0.0;
+}
+
+void Autofocus::processRegionSet(Worker& worker, const cv::Mat& image, const std::vector<cv::Rect>& regions, cv::Mat& field, const cv::Mat* mask)
+{
+    if (regionCost(regions, image.size()) < 1.0)
+    {
+        for (const cv::Rect& region : regions)
+            processRegion(worker, image, region, field, mask);
+        return;
+    }
+
+    // cheaper as one full frame, the regions are copied out of it (the frame border stays as it is)
+    processWith(worker, image, worker.regionField, true);
+    cv::Rect interior(1, 1, image.cols - 2, image.rows - 2);
+    for (const cv::Rect& region : regions)
+    {
+        cv::Rect target = region & interior;
+        if (target.empty())
+            continue;
+        if (mask)
+            worker.regionField(target).copyTo(field(target), (*mask)(target));
+        else
+            worker.regionField(target).copyTo(field(target));
+    }
+}
+
+void Autofocus::processRegions(const cv::Mat& image, const std::vector<cv::Rect>& regions, cv::Mat& field)
+{
+    CV_Assert(settings.convergenceThreshold == 0.0); // the stop level would be decided per crop
+    prepareField(image.size(), settings.outputType, field);
+
+    WorkerLease worker(*this);
+    processRegionSet(*worker, image, regions, field, nullptr);
+}
+
+std::vector<cv::Rect> Autofocus::rectsFromTiles(const cv::Mat& tiles, int tileSize, const cv::Size& size)
+{
+    CV_Assert(tiles.type() == CV_8UC1 && tileSize > 0);
+
+    // a run that is still growing downwards, in tiles
+    struct OpenRect
+    {
+        int xBegin, xEnd, yBegin;
+    };
+
+    std::vector<cv::Rect> rects;
+    std::vector<OpenRect> open, stillOpen;
+    auto close = [&](const OpenRect& run, int yEnd)
+    {
+        cv::Rect rect(run.xBegin * tileSize, run.yBegin * tileSize, (run.xEnd - run.xBegin) * tileSize, (yEnd - run.yBegin) * tileSize);
+        rects.push_back(rect & cv::Rect(0, 0, size.width, size.height));
+    };
+
+    for (int y = 0; y <= tiles.rows; y++)
+    {
+        // runs of this row continue the open rectangle above them if it spans exactly the same tiles
+        stillOpen.clear();
+        const uchar* row = y < tiles.rows ? tiles.ptr<uchar>(y) : nullptr;
+        size_t above = 0;
+        for (int x = 0; row && x < tiles.cols; x++)
+        {
+            if (!row[x])
+                continue;
+            int xEnd = x;
+            while (xEnd < tiles.cols && row[xEnd])
+                xEnd++;
+
+            for (; above < open.size() && open[above].xBegin < x; above++)
+                close(open[above], y);
+            if (above < open.size() && open[above].xBegin == x && open[above].xEnd == xEnd)
+                stillOpen.push_back(open[above++]);
+            else
+                stillOpen.push_back({ x, xEnd, y });
+            x = xEnd;
+        }
+        for (; above < open.size(); above++)
+            close(open[above], y);
+        open.swap(stillOpen);
+    }
+    return rects;
+}
+
+void Autofocus::processMask(const cv::Mat& image, const cv::Mat& mask, cv::Mat& field)
+{
+    CV_Assert(settings.convergenceThreshold == 0.0); // the stop level would be decided per crop
+    CV_Assert(mask.type() == CV_8UC1 && mask.size() == image.size());
+    prepareField(image.size(), settings.outputType, field);
+
+    cv::Mat tiles((mask.rows + maskTileSize - 1) / maskTileSize, (mask.cols + maskTileSize - 1) / maskTileSize, CV_8UC1);
+    for (int y = 0; y < tiles.rows; y++)
+    {
+        for (int x = 0; x < tiles.cols; x++)
+        {
+            cv::Rect tile = cv::Rect(x * maskTileSize, y * maskTileSize, maskTileSize, maskTileSize) & cv::Rect(0, 0, mask.cols, mask.rows);
+            tiles.at<uchar>(y, x) = cv::countNonZero(mask(tile)) > 0 ? 1 : 0;
+        }
+    }
+
+    WorkerLease worker(*this);
+    processRegionSet(*worker, image, rectsFromTiles(tiles, maskTileSize, mask.size()), field, &mask);
+}
+
+bool ReadFileBytes(const std::string& path, std::vector<uchar>& bytes)
+{
+    // a directory opens fine on some platforms and seeks to a garbage size, tellg is -1 when the stream can not seek at
+    // all. both have to fail here, before the size goes into resize.
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(path, error))
+        return false;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+
+    std::streamsize size = file.tellg();
+    if (size <= 0)
+        return false;
+    file.seekg(0);
+    bytes.resize((size_t)size); // keeps the capacity of earlier, bigger files
+    return file.read(reinterpret_cast<char*>(bytes.data()), size).good();
+}
+
+// one image per index. images or paths is null, whichever the batch does not use.
+class Autofocus::BatchBody : public cv::ParallelLoopBody
+{
+public:
+    BatchBody(Autofocus& owner, const std::vector<cv::Mat>* images, const std::vector<std::string>* paths, int imreadFlags, std::vector<cv::Mat>& fields, std::vector<int>& stopLevels)
+        : owner(owner), images(images), paths(paths), imreadFlags(imreadFlags), fields(fields), stopLevels(stopLevels) {}
+
+    void operator()(const cv::Range& range) const override
+    {
+        WorkerLease worker(owner);
+        for (int i = range.start; i < range.end; i++)
+        {
+            // imdecode into the worker's mat reuses its buffer when the size and type match
+            bool loaded = images || (ReadFileBytes((*paths)[i], worker->fileBytes) && !cv::imdecode(worker->fileBytes, imreadFlags, &worker->decoded).empty());
+            const cv::Mat& image = images ? (*images)[i] : worker->decoded;
+
+            // anything the kernels would assert on (empty, alpha, 16 bit) fails this image only, not the whole batch
+            if (!loaded || image.empty() || (image.type() != CV_8UC1 && image.type() != CV_8UC3))
+            {
+                fields[i].release();
+                stopLevels[i] = -1;
+                continue;
+            }
+            stopLevels[i] = owner.processWith(*worker, image, fields[i], false);
+        }
+    }
+
+private:
+    Autofocus& owner;
+    const std::vector<cv::Mat>* images;
+    const std::vector<std::string>* paths;
+    int imreadFlags;
+    std::vector<cv::Mat>& fields;
+    std::vector<int>& stopLevels;
+};
+
+void Autofocus::processBatch(const std::vector<cv::Mat>& images, std::vector<cv::Mat>& fields, std::vector<int>* stopLevels)
+{
+    std::vector<int> unusedStopLevels;
+    std::vector<int>& levels = stopLevels ? *stopLevels : unusedStopLevels;
+    fields.resize(images.size());
+    levels.resize(images.size());
+    cv::parallel_for_(cv::Range(0, (int)images.size()), BatchBody(*this, &images, nullptr, 0, fields, levels));
+}
+
+void Autofocus::processFiles(const std::vector<std::string>& paths, std::vector<cv::Mat>& fields, int imreadFlags, std::vector<int>* stopLevels)
+{
+    std::vector<int> unusedStopLevels;
+    std::vector<int>& levels = stopLevels ? *stopLevels : unusedStopLevels;
+    fields.resize(paths.size());
+    levels.resize(paths.size());
+    cv::parallel_for_(cv::Range(0, (int)paths.size()), BatchBody(*this, nullptr, &paths, imreadFlags, fields, levels));
+}
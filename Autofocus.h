@@ -0,0 +1,159 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include "AutofocusPyramid.h"
+#include "AutofocusAnalytic.h"
+
+// the autofocus algorithm as a library, for offline jobs that push a lot of images through it.
+// an image goes in, its blur levels are built in process (AutofocusPyramid) and the level loop runs from the most
+// blurred level down to lastLevel, the result is one direction field per image (CV_32FC2 by default, see
+// AutofocusKernels.h for the formats).
+// nothing is allocated per image once the pool is warm: every worker keeps its pyramid, float buffers and file buffer,
+// and the output fields are the caller's mats, reused as long as they keep their size and type. so passing the same
+// fields vector batch after batch processes images of a fixed size without touching the allocator.
+// a batch runs one image per thread on opencv's thread pool (cv::setNumThreads), a single image runs its level passes
+// in row bands instead.
+class Autofocus
+{
+public:
+    enum Engine
+    {
+        DiscreteLevels, // blur levels + GetStimuli on every pair, the original algorithm
+        AnalyticDerivatives // AutofocusAnalytic on the last pair's sigmas, no levels and a single pass
+    };
+
+    struct Settings
+    {
+        Engine engine = DiscreteLevels;
+        std::vector<float> sigmas = AutofocusPyramid::linearSigmas(9, 1.0f);
+        AutofocusPyramid::BlurMode blurMode = AutofocusPyramid::Gaussian;
+        int lastLevel = 1; // least blurred level the loop goes down to, autofocus_clean.cpp stops at 1
+        int outputType = CV_32FC2; // or CV_8UC3 for the visual encoding
+
+        // early termination. after every level pass the directions are quantized to the 8 neighbor directions and
+        // the loop stops once less than this fraction of the pixels changed theirs, 0 always runs down to lastLevel.
+        // the skipped levels are not even blurred: with early termination the gaussian levels are not chained, every
+        // level is blurred from the frame right before its pass (a wider kernel per level, so a run that does not
+        // stop early costs more than the chained build). the levels then differ from the chained ones by blur
+        // rounding only. processRegions and processMask do not support it.
+        double convergenceThreshold = 0.0;
+        int minPasses = 2; // the first pass compares against nothing, so it never counts as converged
+
+        bool chainLevels() const { return convergenceThreshold <= 0.0; }
+    };
+
+    Autofocus() : Autofocus(Settings()) {}
+    explicit Autofocus(const Settings& settings);
+
+    const Settings& getSettings() const { return settings; }
+
+    // one image, CV_8UC1 or CV_8UC3. returns the level the loop stopped at (the less blurred level of its last pass),
+    // lastLevel unless early termination kicked in.
+    int process(const cv::Mat& image, cv::Mat& field);
+
+    // fields[i] is the result of images[i]. fields is resized to the batch size, mats already in it are reused.
+    // stopLevels (optional) gets what process would have returned for every image. an empty image or one that is
+    // neither CV_8UC1 nor CV_8UC3 gets an empty field and a stop level of -1, the rest of the batch goes on.
+    void processBatch(const std::vector<cv::Mat>& images, std::vector<cv::Mat>& fields, std::vector<int>* stopLevels = nullptr);
+
+    // same for image files, decoded with cv::imdecode into per worker buffers instead of a fresh imread mat per file.
+    // a file that can not be read, or decodes to anything but CV_8UC1 / CV_8UC3 (IMREAD_UNCHANGED keeps alpha and 16
+    // bit pngs as they are), gets an empty field and a stop level of -1.
+    void processFiles(const std::vector<std::string>& paths, std::vector<cv::Mat>& fields, int imreadFlags = cv::IMREAD_COLOR, std::vector<int>* stopLevels = nullptr);
+
+    // region of interest mode, for when only a few detection boxes matter. levels and directions are only computed
+    // inside the regions plus the halo the blur and the 3x3 stencil need (AutofocusPyramid::haloRadius() + 1), so the
+    // cost follows the region area instead of the frame area. inside the regions field gets the same values the full
+    // frame run would give, everything outside is left as it is (cleared to "no direction" if field had to be
+    // allocated). overlapping regions are computed once per region. the halo is smallest with BoxApproximation (22
+    // pixels for the default sigmas against 85 for the chained gaussian, whose kernel radii add up along the chain).
+    // the halo makes many small or thin regions cost more than the frame they sit in, so once the crops add up to a full
+    // frame (regionCost >= 1) the whole frame is processed once and the regions are copied out of it instead.
+    // needs convergenceThreshold 0: early termination would pick the stop level per crop from the pixels in it, so
+    // a region would not stop where the full frame does.
+    // labels like the ones memorytest1.cpp writes (inclusive xMin / xMax / yMin / yMax) go through rectFromLabel.
+    void processRegions(const cv::Mat& image, const std::vector<cv::Rect>& regions, cv::Mat& field);
+
+    // same with a CV_8UC1 mask (nonzero = wanted). the mask is covered with maskTileSize tiles, the touched tiles are
+    // merged into rectangles (rectsFromTiles) that go the processRegions way, and only the masked pixels are written.
+    void processMask(const cv::Mat& image, const cv::Mat& mask, cv::Mat& field);
+
+    // what processRegions would crop for these regions, their areas with the halo added over the frame area. 1 costs
+    // about as much as process on the whole frame.
+    double regionCost(const std::vector<cv::Rect>& regions, const cv::Size& size) const;
+
+    static cv::Rect rectFromLabel(int xMin, int xMax, int yMin, int yMax) { return cv::Rect(xMin, yMin, xMax - xMin + 1, yMax - yMin + 1); }
+
+    // the nonzero cells of a CV_8UC1 tile grid (tile (x, y) covers pixels x * tileSize .. of a frame of size) as
+    // rectangles: runs of tiles along a row, stacked with the runs below them as long as those span the same tiles.
+    // every tile ends up in exactly one rectangle and the rectangles are clipped to the frame.
+    static std::vector<cv::Rect> rectsFromTiles(const cv::Mat& tiles, int tileSize, const cv::Size& size);
+
+    // the level loop on levels that are already blurred (like autofocustest1/*.png), levels[0] least blurred
+    static void processLevels(const std::vector<cv::Mat>& levels, int lastLevel, cv::Mat& field, bool parallel = true);
+
+private:
+    struct Worker
+    {
+        AutofocusPyramid pyramid;
+        std::vector<uchar> fileBytes;
+        cv::Mat decoded;
+        cv::Mat directionCodes; // early termination state, see UpdateDirectionCodes
+        cv::Mat regionField; // result of the current region's crop
+
+        std::unique_ptr<AutofocusAnalytic> analytic; // only for the AnalyticDerivatives engine
+
+        Worker(const Settings& settings) : pyramid(settings.sigmas, settings.blurMode, settings.chainLevels())
+        {
+            if (settings.engine == AnalyticDerivatives)
+                analytic.reset(new AutofocusAnalytic(settings.sigmas[settings.lastLevel], settings.sigmas[settings.lastLevel + 1]));
+        }
+    };
+
+    static constexpr int maskTileSize = 32;
+
+    Settings settings;
+    int regionHalo; // AutofocusPyramid::haloRadius() + 1
+
+    // every worker ever made, and the ones not in use right now. workers are only made while the pool warms up, at
+    // most one per thread that ran a batch job at the same time.
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<Worker*> idleWorkers;
+    std::mutex poolLock;
+
+    Worker* acquireWorker();
+    void releaseWorker(Worker* worker);
+
+    // a worker for one scope, back in the pool even when processing throws
+    class WorkerLease
+    {
+    public:
+        explicit WorkerLease(Autofocus& owner) : owner(owner), worker(owner.acquireWorker()) {}
+        ~WorkerLease() { owner.releaseWorker(worker); }
+        WorkerLease(const WorkerLease&) = delete;
+        WorkerLease& operator=(const WorkerLease&) = delete;
+
+        Worker& operator*() const { return *worker; }
+        Worker* operator->() const { return worker; }
+
+    private:
+        Autofocus& owner;
+        Worker* worker;
+    };
+
+    int processWith(Worker& worker, const cv::Mat& image, cv::Mat& field, bool parallel);
+    void processRegion(Worker& worker, const cv::Mat& image, const cv::Rect& region, cv::Mat& field, const cv::Mat* mask);
+    void processRegionSet(Worker& worker, const cv::Mat& image, const std::vector<cv::Rect>& regions, cv::Mat& field, const cv::Mat* mask);
+    static void prepareField(const cv::Size& size, int type, cv::Mat& field);
+
+    class BatchBody;
+};
+
+// reads a whole file into bytes for cv::imdecode, resizing it (the capacity of earlier, bigger files is kept). false
+// for anything that is not a non-empty regular file that reads completely. Autofocus::processFiles and ImagePrefetcher
+// both load through this.
+bool ReadFileBytes(const std::string& path, std::vector<uchar>& bytes);
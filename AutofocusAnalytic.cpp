@@ -0,0 +1,106 @@
+#include "AutofocusAnalytic.h"
+#include "AutofocusCommon.h"
+
+AutofocusAnalytic::AutofocusAnalytic(float currSigma, float prevSigma) : currSigma(currSigma), prevSigma(prevSigma)
+{
+    CV_Assert(currSigma > 0.0f && prevSigma > currSigma);
+
+    laplacianScale = (prevSigma * prevSigma - currSigma * currSigma) / 2.0f;
+    float midSigma = std::sqrt((prevSigma * prevSigma + currSigma * currSigma) / 2.0f);
+
+    cv::Mat unused;
+    makeKernels(currSigma, smoothCurr, derivativeCurr, unused);
+    makeKernels(midSigma, smoothMid, unused, secondMid);
+    secondMid *= laplacianScale; // so the laplacian filters give prev - curr directly
+}
+
+// sampled gaussian and its first / second derivative, 4 sigma radius like AutofocusPyramid. the kernels are for
+// sepFilter2D, which correlates, so the first derivative is mirrored (x g(x) / sigma^2 instead of -x g(x) / sigma^2).
+void AutofocusAnalytic::makeKernels(float sigma, cv::Mat& smooth, cv::Mat& derivative, cv::Mat& second)
+{
+    int radius = std::max(1, cvRound(sigma * 4.0f));
+    smooth = cv::getGaussianKernel(radius * 2 + 1, sigma, CV_32F);
+    derivative.create(radius * 2 + 1, 1, CV_32F);
+    second.create(radius * 2 + 1, 1, CV_32F);
+
+    const float* g = smooth.ptr<float>();
+    float* d1 = derivative.ptr<float>();
+    float* d2 = second.ptr<float>();
+    float s2 = sigma * sigma, sum = 0.0f;
+    for (int i = -radius; i <= radius; i++)
+    {
+        d1[i + radius] = i / s2 * g[i + radius];
+        d2[i + radius] = (i * i / (s2 * s2) - 1.0f / s2) * g[i + radius];
+        sum += d2[i + radius];
+    }
+
+    // a sampled second derivative does not sum to exactly 0, a flat image must not get a laplacian
+    for (int i = 0; i < second.rows; i++)
+        d2[i] -= sum / second.rows;
+}
+
+int AutofocusAnalytic::reach() const
+{
+    return std::max(smoothCurr.rows, smoothMid.rows) / 2 + 1;
+}
+
+void AutofocusAnalytic::process(const cv::Mat& frame, cv::Mat& out)
+{
+    CV_Assert(frame.type() == CV_8UC1 || frame.type() == CV_8UC3);
+    CV_Assert(out.empty() || out.type() == CV_8UC3 || out.type() == CV_32FC2);
+    int outType = out.empty() ? CV_8UC3 : out.type();
+    if (out.size() != frame.size())
+    {
+        out.create(frame.size(), outType);
+        out.setTo(cv::Scalar::all(0));
+    }
+
+    int cn = frame.channels();
+    frame.convertTo(frameF, CV_32F);
+    cv::split(frameF, channels);
+    gradientX.resize(cn);
+    gradientY.resize(cn);
+    shift.resize(cn);
+
+    for (int c = 0; c < cn; c++)
+    {
+        cv::sepFilter2D(channels[c], gradientX[c], CV_32F, derivativeCurr, smoothCurr, cv::Point(-1, -1), 0.0, cv::BORDER_REFLECT_101);
+        cv::sepFilter2D(channels[c], gradientY[c], CV_32F, smoothCurr, derivativeCurr, cv::Point(-1, -1), 0.0, cv::BORDER_REFLECT_101);
+        cv::sepFilter2D(channels[c], shift[c], CV_32F, secondMid, smoothMid, cv::Point(-1, -1), 0.0, cv::BORDER_REFLECT_101);
+        cv::sepFilter2D(channels[c], scratch, CV_32F, smoothMid, secondMid, cv::Point(-1, -1), 0.0, cv::BORDER_REFLECT_101);
+        shift[c] += scratch; // prev - curr at the same pixel
+    }
+
+    const float range = 255.0f * cn;
+    for (int y = 1; y < frame.rows - 1; y++)
+    {
+        const float* gx[3];
+        const float* gy[3];
+        const float* a[3];
+        for (int c = 0; c < cn; c++)
+        {
+            gx[c] = gradientX[c].ptr<float>(y);
+            gy[c] = gradientY[c].ptr<float>(y);
+            a[c] = shift[c].ptr<float>(y);
+        }
+
+        for (int x = 1; x < frame.cols - 1; x++)
+        {
+            cv::Point2f dir(0.0f, 0.0f);
+            for (int k = 0; k < 8; k++)
+            {
+                // prev(p) - curr(p + k) from the first order model, same similarity as similarityL1
+                float diff = 0.0f;
+                for (int c = 0; c < cn; c++)
+                    diff += std::abs(a[c][x] - directions[k].x * gx[c][x] - directions[k].y * gy[c][x]);
+                dir += directionsF[k] * (1.0f - std::min(diff, range) / range);
+            }
+            dir = normalize(dir);
+
+            if (outType == CV_32FC2)
+                out.ptr<cv::Vec2f>(y)[x] = cv::Vec2f(dir.x, dir.y);
+            else
+                out.ptr<cv::Vec3b>(y)[x] = cv::Vec3b((int)mapFloatSafe(dir.x, -1.0f, 1.0f, 0.0f, 255.0f), (int)mapFloatSafe(dir.y, -1.0f, 1.0f, 0.0f, 255.0f), 127);
+        }
+    }
+}
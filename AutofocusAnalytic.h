@@ -0,0 +1,42 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// analytic engine, an alternative to building the blur levels and running GetStimuli on every pair.
+// every dense pass overwrites the whole map, so the discrete loop's result is the pass on its last pair (prev = level
+// at prevSigma, curr = level at currSigma). that pass compares prev(p) to curr(p + k) for the 8 neighbors k. by the heat
+// equation dL/d(sigma^2 / 2) = laplacian(L), so
+//     prev(p) - curr(p + k) ~= (prevSigma^2 - currSigma^2) / 2 * laplacian(L)(p) - k . gradient(L)(p)
+// with the laplacian taken at the sigma between the two and the gradient at currSigma. this engine gets those from
+// derivative of gaussian filters on the raw frame (5 separable filters per channel instead of 9 blurs and 8 passes),
+// then puts them through the same similarity sum, normalization, pruning and output encoding as GetStimuli.
+// it is a first order model of the 8 bit levels, so it agrees with the discrete engine where the image is smooth at the
+// level's scale and differs on fine texture and near pruning threshold, see the engine comparison in
+// autofocus_benchmark.cpp.
+class AutofocusAnalytic
+{
+public:
+    AutofocusAnalytic(float currSigma = 1.0f, float prevSigma = 2.0f);
+
+    // frame CV_8UC1 / CV_8UC3, out CV_8UC3 / CV_32FC2 like the kernels (allocated and zeroed if it does not fit),
+    // the 1 pixel border is not written
+    void process(const cv::Mat& frame, cv::Mat& out);
+
+    // pixels of frame that reach one output pixel
+    int reach() const;
+
+private:
+    float currSigma, prevSigma;
+    float laplacianScale; // (prevSigma^2 - currSigma^2) / 2
+    cv::Mat smoothCurr, derivativeCurr; // 1d kernels at currSigma
+    cv::Mat smoothMid, secondMid; // 1d kernels at the sigma between the two
+
+    // per channel filter responses, reused across frames
+    cv::Mat frameF;
+    std::vector<cv::Mat> channels;
+    std::vector<cv::Mat> gradientX, gradientY, shift;
+    cv::Mat scratch;
+
+    static void makeKernels(float sigma, cv::Mat& smooth, cv::Mat& derivative, cv::Mat& second);
+};
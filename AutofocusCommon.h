@@ -0,0 +1,71 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cmath>
+
+// pieces of the autofocus algorithm shared by every autofocus file (autofocus.cpp, AutofocusKernels.cpp, ...), so the
+// neighbor order, the similarity and the output mapping are only defined once.
+
+// the 8 neighbors, left first then clockwise. the kernels accumulate in this order, which matters for bit exactness.
+static const std::vector<cv::Point> directions = { {-1, 0}, {-1, -1}, {0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1} };
+static const std::vector<cv::Point2f> directionsF = 
+{
+    { -1.0f,  0.0f }, // left
+    { -0.7071f, -0.7071f }, // up-left
+    {  0.0f, -1.0f }, // up
+    {  0.7071f, -0.7071f }, // up-right
+    {  1.0f,  0.0f }, // right
+    {  0.7071f,  0.7071f }, // down-right
+    {  0.0f,  1.0f }, // down
+    { -0.7071f,  0.7071f } // down-left
+};
+
+// l1 similarity for memory. for a gray image cn = 1 gives exactly the cn = 3 result of the same image stored as bgr,
+// d / 255 and 3d / 765 are the same real number and float division rounds it the same way.
+template<int CN>
+inline float similarityL1(const cv::Vec<uchar, CN>& a, const cv::Vec<uchar, CN>& b)
+{
+    int diff = 0;
+    for (int c = 0; c < CN; c++)
+        diff += std::abs(a[c] - b[c]);
+
+    return 1.0f - (diff / (255.0f * CN));
+}
+
+// simple normalizing function, also prunes weak signals. the kernels use the default 0.1, their simd paths assume it.
+inline cv::Point2f normalize(const cv::Point2f& v, float minLength = 0.1f)
+{
+    float length = std::sqrt(v.x * v.x + v.y * v.y);
+
+    if (length < minLength)
+        return cv::Point2f(0.0f, 0.0f);
+
+    return cv::Point2f(v.x / length, v.y / length);
+}
+
+inline float mapFloatSafe(float value, float inMin, float inMax, float outMin, float outMax)
+{
+    if (inMax - inMin == 0.0f)
+        return outMin; 
+
+    return outMin + (value - inMin) * (outMax - outMin) / (inMax - inMin);
+}
+
+// 1..8 = the direction sector (45 degrees each, centered on directions[k] so k + 1), 0 = no direction.
+// sectors by comparisons, tan(22.5) = 0.41421.
+inline uchar DirectionCode(float x, float y)
+{
+    float ax = std::abs(x), ay = std::abs(y);
+    if (ax == 0.0f && ay == 0.0f)
+        return 0;
+
+    const float tan225 = 0.41421356f;
+    if (ay <= tan225 * ax)
+        return x < 0.0f ? 1 : 5; // left / right
+    if (ax <= tan225 * ay)
+        return y < 0.0f ? 3 : 7; // up / down
+    if (y < 0.0f)
+        return x < 0.0f ? 2 : 4; // up-left / up-right
+    return x > 0.0f ? 6 : 8; // down-right / down-left
+}
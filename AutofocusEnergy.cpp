@@ -0,0 +1,618 @@
+#include "AutofocusEnergy.h"
+#include <cstring>
+
+using namespace std;
+using namespace cv;
+
+EnergyField::EnergyField(Size size, bool falloff, int tileSize)
+    : size(size), falloff(falloff), tileSize(tileSize)
+{
+    CV_Assert(size.area() > 0 && tileSize > 0);
+    tiles = Size((size.width + tileSize - 1) / tileSize, (size.height + tileSize - 1) / tileSize);
+    buffers[0] = Mat::zeros(size, CV_32FC1);
+    buffers[1] = Mat::zeros(size, CV_32FC1);
+    demand = Mat::zeros(size, CV_32FC1);
+    sourceBins.resize(tiles.area());
+    targetBins.resize(tiles.area());
+}
+
+void EnergyField::reset(const Mat& energy)
+{
+    CV_Assert(energy.size() == size && energy.channels() == 1);
+    energy.convertTo(buffers[current], CV_32F);
+}
+
+const EnergyField::Disc& EnergyField::discFor(float radius)
+{
+    // same membership test as applyImpulseField (dist2 <= r2) with the center on a pixel. dist2 is a whole number, so
+    // only the whole part of r2 decides which pixels are in
+    int squared = (int)floor(radius * radius);
+    auto found = discs.find(squared);
+    if (found != discs.end())
+        return found->second;
+
+    Disc& disc = discs[squared];
+    disc.radius = (int)sqrt((double)squared);
+    while ((disc.radius + 1) * (disc.radius + 1) <= squared)
+        disc.radius++;
+    while (disc.radius * disc.radius > squared)
+        disc.radius--;
+    for (int dy = -disc.radius; dy <= disc.radius; dy++)
+    {
+        DiscSpan span = { dy, 0, 0, (int)disc.distances.size() };
+        for (int dx = -disc.radius; dx <= disc.radius; dx++)
+        {
+            int dist2 = dx * dx + dy * dy;
+            if (dist2 > squared)
+                continue;
+            if (span.count == 0)
+                span.dxBegin = dx;
+            span.count++;
+            disc.distances.push_back(sqrt((float)dist2));
+        }
+        if (span.count > 0)
+            disc.spans.push_back(span);
+    }
+    return disc;
+}
+
+void EnergyField::bin(vector<vector<int>>& bins, int impulse, Point center, int radius)
+{
+    int x0 = max(0, center.x - radius), x1 = min(size.width - 1, center.x + radius);
+    int y0 = max(0, center.y - radius), y1 = min(size.height - 1, center.y + radius);
+    if (x0 > x1 || y0 > y1)
+        return;
+
+    for (int ty = y0 / tileSize; ty <= y1 / tileSize; ty++)
+        for (int tx = x0 / tileSize; tx <= x1 / tileSize; tx++)
+            bins[ty * tiles.width + tx].push_back(impulse);
+}
+
+// the three passes of a step, each one tile per task. a tile only writes its own pixels of demand / next.
+class EnergyField::TileBody : public ParallelLoopBody
+{
+public:
+    enum Pass { Demand, Take, Arrive };
+
+    TileBody(EnergyField& field, Pass pass) : field(field), pass(pass) {}
+
+    void operator()(const Range& range) const override
+    {
+        for (int tile = range.start; tile < range.end; tile++)
+        {
+            int tx = tile % field.tiles.width, ty = tile / field.tiles.width;
+            Rect rect = Rect(tx * field.tileSize, ty * field.tileSize, field.tileSize, field.tileSize) & Rect(Point(0, 0), field.size);
+            if (pass == Demand)
+                demand(tile, rect);
+            else if (pass == Take)
+                take(rect);
+            else
+                arrive(tile, rect);
+        }
+    }
+
+private:
+    EnergyField& field;
+    Pass pass;
+
+    // sum of strength * weight of every disc over the tile
+    void demand(int tile, const Rect& rect) const
+    {
+        field.demand(rect).setTo(0);
+        for (int index : field.sourceBins[tile])
+        {
+            const PlacedImpulse& impulse = field.placed[index];
+            for (const DiscSpan& span : impulse.disc->spans)
+            {
+                int y = impulse.center.y + span.dy;
+                if (y < rect.y || y >= rect.y + rect.height)
+                    continue;
+                int x0 = impulse.center.x + span.dxBegin;
+                int xBegin = max(x0, rect.x), xEnd = min(x0 + span.count, rect.x + rect.width);
+                float* row = field.demand.ptr<float>(y);
+                const float* distances = &impulse.disc->distances[span.distanceOffset];
+                for (int x = xBegin; x < xEnd; x++)
+                    row[x] += max(0.0f, impulse.strength - impulse.slope * distances[x - x0]);
+            }
+        }
+    }
+
+    // takes what was asked for, or all of the pixel if that is less. demand becomes the fraction every impulse gets.
+    void take(const Rect& rect) const
+    {
+        const Mat& energy = field.buffers[field.current];
+        Mat& next = field.buffers[1 - field.current];
+        for (int y = rect.y; y < rect.y + rect.height; y++)
+        {
+            const float* in = energy.ptr<float>(y);
+            float* out = next.ptr<float>(y);
+            float* asked = field.demand.ptr<float>(y);
+            for (int x = rect.x; x < rect.x + rect.width; x++)
+            {
+                float taken = max(0.0f, min(in[x], asked[x]));
+                out[x] = in[x] - taken;
+                asked[x] = asked[x] > 0.0f ? taken / asked[x] : 0.0f;
+            }
+        }
+    }
+
+    // every disc pixel that lands in the tile after the travel offset adds its share
+    void arrive(int tile, const Rect& rect) const
+    {
+        Mat& next = field.buffers[1 - field.current];
+        for (int index : field.targetBins[tile])
+        {
+            const PlacedImpulse& impulse = field.placed[index];
+            for (const DiscSpan& span : impulse.disc->spans)
+            {
+                int y = impulse.center.y + span.dy;
+                int targetY = y + impulse.offset.y;
+                if (y < 0 || y >= field.size.height || targetY < rect.y || targetY >= rect.y + rect.height)
+                    continue;
+                int x0 = impulse.center.x + span.dxBegin;
+                int xBegin = max({ x0, 0, rect.x - impulse.offset.x });
+                int xEnd = min({ x0 + span.count, field.size.width, rect.x + rect.width - impulse.offset.x });
+                const float* fraction = field.demand.ptr<float>(y);
+                float* out = next.ptr<float>(targetY);
+                const float* distances = &impulse.disc->distances[span.distanceOffset];
+                for (int x = xBegin; x < xEnd; x++)
+                    out[x + impulse.offset.x] += max(0.0f, impulse.strength - impulse.slope * distances[x - x0]) * fraction[x];
+            }
+        }
+    }
+};
+
+void EnergyField::step(const vector<EnergyImpulse>& impulses)
+{
+    placed.clear();
+    if (discs.size() > maxCachedDiscs)
+        discs.clear(); // only between steps, placed impulses point into it
+    for (vector<int>& bin : sourceBins)
+        bin.clear();
+    for (vector<int>& bin : targetBins)
+        bin.clear();
+
+    for (const EnergyImpulse& impulse : impulses)
+    {
+        if (impulse.radius <= 0.0f || impulse.strength <= 0.0f)
+            continue;
+        PlacedImpulse p;
+        p.disc = &discFor(impulse.radius);
+        p.center = Point(cvRound(impulse.center.x), cvRound(impulse.center.y));
+        p.offset = Point(cvRound(impulse.direction.x * impulse.travelDistance), cvRound(impulse.direction.y * impulse.travelDistance));
+        p.strength = impulse.strength;
+        p.slope = falloff && impulse.radius > 0.0f ? impulse.strength / impulse.radius : 0.0f;
+
+        int index = (int)placed.size();
+        placed.push_back(p);
+        bin(sourceBins, index, p.center, p.disc->radius);
+        bin(targetBins, index, p.center + p.offset, p.disc->radius);
+    }
+
+    // each pass needs all of the one before it, so they can not share a parallel_for_
+    for (TileBody::Pass pass : { TileBody::Demand, TileBody::Take, TileBody::Arrive })
+        parallel_for_(Range(0, tiles.area()), TileBody(*this, pass));
+    current = 1 - current;
+}
+
+void AppendEnergyImpulses(const DirectionImpulses& impulses, float radius, float strength, float travelDistance, vector<EnergyImpulse>& out)
+{
+    out.reserve(out.size() + impulses.impulses.size());
+    for (const DirectionImpulse& impulse : impulses.impulses)
+        out.push_back({ Point2f((float)impulse.x, (float)impulse.y), impulse.direction, radius, strength * impulse.magnitude, travelDistance });
+}
+
+// energy accumulation experiment 2
+void propagateIfOppositeMulti(
+    const Point& point,
+    const Point2f& dir, // must be normalized
+    const Mat& directionField, // CV_32FC2
+    Mat& gray, // CV_32F or CV_8U
+    int steps, // how many pixels to sample
+    float valueToAdd,
+    float oppositeThreshold
+) {
+    CV_Assert(directionField.type() == CV_32FC2);
+    CV_Assert(gray.channels() == 1);
+
+    Vec2f avgDir(0.f, 0.f);
+    int validCount = 0;
+
+    // sample several pixels forward
+    for (int i = 1; i <= steps; i++)
+    {
+        int nx = point.x + (int)round(dir.x * i);
+        int ny = point.y + (int)round(dir.y * i);
+
+        if (nx < 0 || ny < 0 || nx >= directionField.cols || ny >= directionField.rows)
+            break;
+
+        Vec2f sample = directionField.at<Vec2f>(ny, nx);
+
+        float len = sqrt(sample[0] * sample[0] + sample[1] * sample[1]);
+        if (len > 0.0001f)
+        {
+            avgDir += sample / len; // ensure normalized
+            validCount++;
+        }
+    }
+
+    // If no valid neighbors found
+    if (validCount == 0)
+        return;
+
+    avgDir /= (float)validCount;
+
+    float avgLen = sqrt(avgDir[0] * avgDir[0] + avgDir[1] * avgDir[1]);
+    if (avgLen > 0.0001f)
+        avgDir /= avgLen;
+
+    int closestX = point.x + (int)round(dir.x);
+    int closestY = point.y + (int)round(dir.y);
+
+    if (closestX < 0 || closestY < 0 ||
+        closestX >= directionField.cols || closestY >= directionField.rows)
+        return;
+
+    // dot product (are they opposite?)
+    float dot = dir.x * avgDir[0] + dir.y * avgDir[1];
+
+    if (dot <= oppositeThreshold)
+    {
+        if (gray.type() == CV_32F)
+        {
+            gray.at<float>(closestY, closestX) += valueToAdd;
+        }
+        else if (gray.type() == CV_8U)
+        {
+            int newVal = gray.at<uchar>(closestY, closestX) + valueToAdd;
+            gray.at<uchar>(closestY, closestX) = saturate_cast<uchar>(newVal);
+        }
+    }
+}
+
+// everything the whole field passes share. the arithmetic below repeats propagateIfOppositeMulti operation by
+// operation (Vec2f / float multiplies by the reciprocal), that is what keeps the result identical.
+struct PropagateState
+{
+    PropagateState(const Mat& field, Mat& gray, int steps, float valueToAdd, float threshold, int bandRows)
+        : field(field), gray(gray), steps(steps), valueToAdd(valueToAdd), threshold(threshold), bandRows(bandRows) {}
+
+    const Mat& field;
+    Mat& gray;
+    int steps;
+    float valueToAdd, threshold;
+    int bandRows;
+    Mat normalized; // CV_32FC2, the field divided by its length, (0, 0) where it is too short to count as a sample
+    Mat codes; // CV_8UC1, which neighbor a pixel adds to, 0 for none
+    vector<vector<Point>> far; // per band, targets more than one pixel away (directions longer than 1.5)
+};
+
+static inline uchar NeighborCode(int dx, int dy)
+{
+    return (uchar)(1 + (dy + 1) * 3 + dx + 1);
+}
+
+static inline void NormalizeScalar(const float* in, float* out)
+{
+    float len = sqrt(in[0] * in[0] + in[1] * in[1]);
+    float inverse = 1.0f / len;
+    out[0] = len > 0.0001f ? in[0] * inverse : 0.0f;
+    out[1] = len > 0.0001f ? in[1] * inverse : 0.0f;
+}
+
+static inline void MarkTarget(PropagateState& state, int band, int x, int y, int dx, int dy, uchar* code)
+{
+    if (dx >= -1 && dx <= 1 && dy >= -1 && dy <= 1)
+        *code = NeighborCode(dx, dy);
+    else
+        state.far[band].push_back(Point(x + dx, y + dy));
+}
+
+// propagateIfOppositeMulti for one pixel up to the write
+static void FirePixelScalar(PropagateState& state, int band, int x, int y)
+{
+    const Mat& normalized = state.normalized;
+    const float* dir = state.field.ptr<float>(y) + x * 2;
+    if (dir[0] == 0.0f && dir[1] == 0.0f)
+        return;
+    float sumX = 0.0f, sumY = 0.0f;
+    int count = 0;
+    for (int i = 1; i <= state.steps; i++)
+    {
+        int nx = x + (int)round(dir[0] * i);
+        int ny = y + (int)round(dir[1] * i);
+        if (nx < 0 || ny < 0 || nx >= normalized.cols || ny >= normalized.rows)
+            break;
+
+        const float* sample = normalized.ptr<float>(ny) + nx * 2;
+        if (sample[0] != 0.0f || sample[1] != 0.0f)
+        {
+            sumX += sample[0];
+            sumY += sample[1];
+            count++;
+        }
+    }
+    if (count == 0)
+        return;
+
+    float inverse = 1.0f / (float)count;
+    float avgX = sumX * inverse, avgY = sumY * inverse;
+    float avgLen = sqrt(avgX * avgX + avgY * avgY);
+    if (avgLen > 0.0001f)
+    {
+        float inverseLen = 1.0f / avgLen;
+        avgX *= inverseLen;
+        avgY *= inverseLen;
+    }
+
+    int dx = (int)round(dir[0]), dy = (int)round(dir[1]);
+    if (x + dx < 0 || y + dy < 0 || x + dx >= normalized.cols || y + dy >= normalized.rows)
+        return;
+    if (dir[0] * avgX + dir[1] * avgY <= state.threshold)
+        MarkTarget(state, band, x, y, dx, dy, state.codes.ptr<uchar>(y) + x);
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AUTOFOCUS_ENERGY_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define AUTOFOCUS_ENERGY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define AUTOFOCUS_ENERGY_TARGET(isa)
+#endif
+
+// round() of 4 floats, halves away from 0. x - trunc(x) is exact, so this rounds like the scalar round.
+AUTOFOCUS_ENERGY_TARGET("sse4.1")
+static inline __m128 RoundHalfAwaySSE41(__m128 v)
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f), half = _mm_set1_ps(0.5f), one = _mm_set1_ps(1.0f);
+    __m128 truncated = _mm_round_ps(v, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    __m128 up = _mm_cmpge_ps(_mm_andnot_ps(signMask, _mm_sub_ps(v, truncated)), half);
+    return _mm_add_ps(truncated, _mm_and_ps(up, _mm_or_ps(_mm_and_ps(v, signMask), one)));
+}
+
+AUTOFOCUS_ENERGY_TARGET("sse4.1")
+static int NormalizeRowSSE41(const float* in, float* out, int cols)
+{
+    const __m128 minimum = _mm_set1_ps(0.0001f), one = _mm_set1_ps(1.0f);
+    int x = 0;
+    for (; x <= cols - 4; x += 4)
+    {
+        __m128 a = _mm_loadu_ps(in + x * 2), b = _mm_loadu_ps(in + x * 2 + 4);
+        __m128 dx = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), dy = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+        __m128 inverse = _mm_div_ps(one, len), valid = _mm_cmpgt_ps(len, minimum);
+        dx = _mm_and_ps(_mm_mul_ps(dx, inverse), valid);
+        dy = _mm_and_ps(_mm_mul_ps(dy, inverse), valid);
+        _mm_storeu_ps(out + x * 2, _mm_unpacklo_ps(dx, dy));
+        _mm_storeu_ps(out + x * 2 + 4, _mm_unpackhi_ps(dx, dy));
+    }
+    return x;
+}
+
+// 4 pixels per iteration. the sample positions, the averaging and the opposite test are vectorized, the samples
+// themselves are gathered lane by lane while at least one lane is still inside the field.
+AUTOFOCUS_ENERGY_TARGET("sse4.1")
+static int FireRowSSE41(PropagateState& state, int band, int y)
+{
+    const Mat& normalized = state.normalized;
+    const int cols = normalized.cols, rows = normalized.rows;
+    const __m128 minimum = _mm_set1_ps(0.0001f), one = _mm_set1_ps(1.0f), threshold = _mm_set1_ps(state.threshold);
+    const __m128i colLimit = _mm_set1_epi32(cols), rowLimit = _mm_set1_epi32(rows), minusOne = _mm_set1_epi32(-1);
+    const float* in = state.field.ptr<float>(y);
+    uchar* codes = state.codes.ptr<uchar>(y);
+
+    int x = 0;
+    for (; x <= cols - 4; x += 4)
+    {
+        __m128 a = _mm_loadu_ps(in + x * 2), b = _mm_loadu_ps(in + x * 2 + 4);
+        // a pixel without direction samples itself steps times, finds (0, 0) and never fires. most pixels are like that.
+        if (_mm_movemask_ps(_mm_cmpneq_ps(_mm_or_ps(a, b), _mm_setzero_ps())) == 0)
+            continue;
+        __m128 dirX = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), dirY = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m128i xs = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3)), ys = _mm_set1_epi32(y);
+
+        __m128 sumX = _mm_setzero_ps(), sumY = _mm_setzero_ps();
+        __m128i count = _mm_setzero_si128(), inside = minusOne, closestInside = _mm_setzero_si128();
+        __m128i closestX = _mm_setzero_si128(), closestY = _mm_setzero_si128();
+        for (int i = 1; i <= state.steps; i++)
+        {
+            __m128 step = _mm_set1_ps((float)i);
+            __m128i offsetX = _mm_cvttps_epi32(RoundHalfAwaySSE41(_mm_mul_ps(dirX, step)));
+            __m128i offsetY = _mm_cvttps_epi32(RoundHalfAwaySSE41(_mm_mul_ps(dirY, step)));
+            __m128i nx = _mm_add_epi32(xs, offsetX), ny = _mm_add_epi32(ys, offsetY);
+            // a lane stops at its first step outside, like the break
+            __m128i in = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(nx, minusOne), _mm_cmplt_epi32(nx, colLimit)),
+                _mm_and_si128(_mm_cmpgt_epi32(ny, minusOne), _mm_cmplt_epi32(ny, rowLimit)));
+            inside = _mm_and_si128(inside, in);
+            if (i == 1)
+            {
+                closestInside = inside;
+                closestX = offsetX;
+                closestY = offsetY;
+            }
+            int insideMask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+            if (!insideMask)
+                break;
+
+            alignas(16) int px[4], py[4];
+            alignas(16) float sx[4] = { 0.0f, 0.0f, 0.0f, 0.0f }, sy[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            _mm_store_si128((__m128i*)px, nx);
+            _mm_store_si128((__m128i*)py, ny);
+            for (int lane = 0; lane < 4; lane++)
+            {
+                if (insideMask & (1 << lane))
+                {
+                    const float* sample = normalized.ptr<float>(py[lane]) + px[lane] * 2;
+                    sx[lane] = sample[0];
+                    sy[lane] = sample[1];
+                }
+            }
+            // adding the (0, 0) of a short sample or an outside lane changes nothing, the sums are never -0
+            __m128 sampleX = _mm_load_ps(sx), sampleY = _mm_load_ps(sy);
+            __m128 valid = _mm_or_ps(_mm_cmpneq_ps(sampleX, _mm_setzero_ps()), _mm_cmpneq_ps(sampleY, _mm_setzero_ps()));
+            sumX = _mm_add_ps(sumX, sampleX);
+            sumY = _mm_add_ps(sumY, sampleY);
+            count = _mm_sub_epi32(count, _mm_castps_si128(valid));
+        }
+
+        __m128 inverse = _mm_div_ps(one, _mm_cvtepi32_ps(count));
+        __m128 avgX = _mm_mul_ps(sumX, inverse), avgY = _mm_mul_ps(sumY, inverse);
+        __m128 avgLen = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(avgX, avgX), _mm_mul_ps(avgY, avgY)));
+        __m128 longEnough = _mm_cmpgt_ps(avgLen, minimum), inverseLen = _mm_div_ps(one, avgLen);
+        avgX = _mm_blendv_ps(avgX, _mm_mul_ps(avgX, inverseLen), longEnough);
+        avgY = _mm_blendv_ps(avgY, _mm_mul_ps(avgY, inverseLen), longEnough);
+        __m128 dot = _mm_add_ps(_mm_mul_ps(dirX, avgX), _mm_mul_ps(dirY, avgY));
+
+        __m128 fire = _mm_and_ps(_mm_cmple_ps(dot, threshold),
+            _mm_castsi128_ps(_mm_and_si128(closestInside, _mm_cmpgt_epi32(count, _mm_setzero_si128()))));
+        int fireMask = _mm_movemask_ps(fire);
+        if (!fireMask)
+            continue;
+
+        alignas(16) int dx[4], dy[4];
+        _mm_store_si128((__m128i*)dx, closestX);
+        _mm_store_si128((__m128i*)dy, closestY);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (fireMask & (1 << lane))
+                MarkTarget(state, band, x + lane, y, dx[lane], dy[lane], codes + x + lane);
+        }
+    }
+    return x;
+}
+#endif
+
+static void AddTimes(Mat& gray, int x, int y, int times, float valueToAdd)
+{
+    // the same add repeated, so the order of the per pixel calls did not matter either
+    if (gray.type() == CV_32F)
+    {
+        float& value = gray.at<float>(y, x);
+        for (int i = 0; i < times; i++)
+            value += valueToAdd;
+    }
+    else if (gray.type() == CV_8U)
+    {
+        uchar& value = gray.at<uchar>(y, x);
+        for (int i = 0; i < times; i++)
+            value = saturate_cast<uchar>((int)(value + valueToAdd));
+    }
+}
+
+// normalize, fire and gather, each a pass over all bands. fire reads the normalized field steps rows around a band
+// and gather the codes one row around it, so every pass has to finish before the next starts.
+class PropagateBandBody : public ParallelLoopBody
+{
+public:
+    enum Pass { Normalize, Fire, Gather };
+
+    PropagateBandBody(PropagateState& state, Pass pass) : state(state), pass(pass) {}
+
+    void operator()(const Range& bands) const override
+    {
+#ifdef AUTOFOCUS_ENERGY_X86
+        static const bool useSSE41 = checkHardwareSupport(CV_CPU_SSE4_1);
+#endif
+        const int cols = state.field.cols;
+        vector<int> times;
+        for (int band = bands.start; band < bands.end; band++)
+        {
+            int yBegin = band * state.bandRows, yEnd = min(state.field.rows, yBegin + state.bandRows);
+            for (int y = yBegin; y < yEnd; y++)
+            {
+                int x = 0;
+                if (pass == Normalize)
+                {
+                    const float* in = state.field.ptr<float>(y);
+                    float* out = state.normalized.ptr<float>(y);
+#ifdef AUTOFOCUS_ENERGY_X86
+                    if (useSSE41)
+                        x = NormalizeRowSSE41(in, out, cols);
+#endif
+                    for (; x < cols; x++)
+                        NormalizeScalar(in + x * 2, out + x * 2);
+                }
+                else if (pass == Fire)
+                {
+                    memset(state.codes.ptr<uchar>(y), 0, cols);
+#ifdef AUTOFOCUS_ENERGY_X86
+                    if (useSSE41)
+                        x = FireRowSSE41(state, band, y);
+#endif
+                    for (; x < cols; x++)
+                        FirePixelScalar(state, band, x, y);
+                }
+                else
+                    GatherRow(y, times);
+            }
+        }
+    }
+
+private:
+    PropagateState& state;
+    Pass pass;
+
+    // counts the neighbors that fire at every pixel of row y, only the nonzero codes of the 3 source rows are looked at
+    void GatherRow(int y, vector<int>& times) const
+    {
+        const Mat& codes = state.codes;
+        times.assign(codes.cols, 0);
+        for (int sourceY = max(0, y - 1); sourceY <= min(codes.rows - 1, y + 1); sourceY++)
+        {
+            const uchar* row = codes.ptr<uchar>(sourceY);
+            int dy = y - sourceY;
+            for (int x = 0; x < codes.cols; x++)
+            {
+                if (!row[x] || (row[x] - 1) / 3 - 1 != dy)
+                    continue;
+                // the code only exists if the target is inside
+                times[x + (row[x] - 1) % 3 - 1]++;
+            }
+        }
+        for (int x = 0; x < codes.cols; x++)
+        {
+            if (times[x])
+                AddTimes(state.gray, x, y, times[x], state.valueToAdd);
+        }
+    }
+};
+
+static void PropagateIfOppositeBands(const Mat& directionField, Mat& gray, int steps, float valueToAdd, float oppositeThreshold, int bandRows, bool parallel)
+{
+    CV_Assert(directionField.type() == CV_32FC2);
+    CV_Assert(gray.channels() == 1 && gray.size() == directionField.size());
+    CV_Assert(bandRows > 0);
+    if (directionField.empty())
+        return;
+
+    int bandCount = (directionField.rows + bandRows - 1) / bandRows;
+    PropagateState state(directionField, gray, steps, valueToAdd, oppositeThreshold, bandRows);
+    state.normalized.create(directionField.size(), CV_32FC2);
+    state.codes.create(directionField.size(), CV_8UC1);
+    state.far.resize(bandCount);
+
+    for (PropagateBandBody::Pass pass : { PropagateBandBody::Normalize, PropagateBandBody::Fire, PropagateBandBody::Gather })
+    {
+        PropagateBandBody body(state, pass);
+        if (parallel)
+            parallel_for_(Range(0, bandCount), body, bandCount);
+        else
+            body(Range(0, bandCount));
+    }
+
+    for (const vector<Point>& targets : state.far)
+        for (const Point& target : targets)
+            AddTimes(gray, target.x, target.y, 1, valueToAdd);
+}
+
+void PropagateIfOpposite(const Mat& directionField, Mat& gray, int steps, float valueToAdd, float oppositeThreshold)
+{
+    PropagateIfOppositeBands(directionField, gray, steps, valueToAdd, oppositeThreshold, max(1, directionField.rows), false);
+}
+
+void PropagateIfOppositeParallel(const Mat& directionField, Mat& gray, int steps, float valueToAdd, float oppositeThreshold, int bandRows)
+{
+    PropagateIfOppositeBands(directionField, gray, steps, valueToAdd, oppositeThreshold, bandRows, true);
+}
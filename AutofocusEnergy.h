@@ -0,0 +1,118 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <unordered_map>
+#include "AutofocusImpulses.h"
+
+// energy transport on a float field, the batched replacement of applyImpulseField from autofocus.cpp. an impulse takes
+// energy out of a disc around its center, up to strength at the center falling off to 0 at radius, and drops it
+// travelDistance pixels further along its direction. applyImpulseField did that for one impulse per call with a sqrt
+// and two at<float> per pixel, EnergyField::step moves a whole batch of them per call.
+//
+// this is not the same computation as applyImpulseField, results differ wherever a center is not on a whole pixel or
+// impulses overlap:
+// - centers and travel offsets are rounded to whole pixels (applyImpulseField measured the distance to the fractional
+//   center), so every impulse whose radius covers the same pixels shares one precomputed disc (offsets and distances),
+//   built the first time such a radius shows up
+// - the whole batch reads the energy from before the step and writes the next buffer (double buffered), an impulse does
+//   not see what the impulses before it moved. where discs overlap and ask for more energy than a pixel has, every
+//   impulse gets the same fraction of what it asked for, so no pixel goes below 0 and the batch order does not matter.
+//   the driver in autofocus.cpp applied its impulses one after another, so it now gives different (order independent)
+//   results where their discs overlap
+// - direction x moves along x (applyImpulseField used dir.y for x, its callers passed swapped points to match)
+//
+// the field is split into tiles that run on opencv's thread pool. every tile only writes its own pixels and goes
+// through the impulses touching it in batch order, so the result is the same bit for bit for any thread count.
+
+struct EnergyImpulse
+{
+    cv::Point2f center;
+    cv::Point2f direction; // normalized
+    float radius;
+    float strength; // how much energy can be moved from the pixel at the center
+    float travelDistance;
+};
+
+class EnergyField
+{
+public:
+    explicit EnergyField(cv::Size size, bool falloff = true, int tileSize = 64);
+
+    // energy is CV_32FC1 (or anything convertTo takes) of the field size
+    void reset(const cv::Mat& energy);
+    const cv::Mat& getEnergy() const { return buffers[current]; }
+
+    // moves the energy of all impulses at once and swaps the buffers
+    void step(const std::vector<EnergyImpulse>& impulses);
+
+private:
+    // one row of a disc: distances[distanceOffset ..] for dx = dxBegin .. dxBegin + count - 1
+    struct DiscSpan
+    {
+        int dy, dxBegin, count, distanceOffset;
+    };
+
+    // the pixels with dx^2 + dy^2 <= a whole number, every radius whose square rounds down to it has the same ones
+    struct Disc
+    {
+        int radius;
+        std::vector<DiscSpan> spans;
+        std::vector<float> distances; // sqrt(dx^2 + dy^2)
+    };
+
+    // an impulse of the current step with its disc looked up and everything rounded. a disc pixel at distance d asks
+    // for max(0, strength - slope * d), slope is strength / radius with falloff and 0 without.
+    struct PlacedImpulse
+    {
+        const Disc* disc;
+        cv::Point center, offset;
+        float strength, slope;
+    };
+
+    class TileBody;
+
+    cv::Size size;
+    bool falloff;
+    int tileSize;
+    cv::Size tiles;
+
+    cv::Mat buffers[2];
+    int current = 0;
+    cv::Mat demand; // energy all impulses ask of a pixel, then the fraction of it they get
+
+    // by the squared radius rounded down. a caller with a different radius for every impulse would grow this forever,
+    // so it starts over at a step once it holds more than maxCachedDiscs
+    std::unordered_map<int, Disc> discs;
+    static constexpr size_t maxCachedDiscs = 256;
+    std::vector<PlacedImpulse> placed;
+    std::vector<std::vector<int>> sourceBins, targetBins; // per tile, the impulses whose disc / moved disc touch it
+
+    const Disc& discFor(float radius);
+    void bin(std::vector<std::vector<int>>& bins, int impulse, cv::Point center, int radius);
+};
+
+// one impulse per entry of impulses, strength scaled by the magnitude of the direction
+void AppendEnergyImpulses(const DirectionImpulses& impulses, float radius, float strength, float travelDistance, std::vector<EnergyImpulse>& out);
+
+// energy accumulation experiment 2 from autofocus.cpp. samples steps pixels of directionField along dir from point and
+// adds valueToAdd to gray (CV_32F or CV_8U) at the neighbor dir points to if their average direction is opposite to dir.
+void propagateIfOppositeMulti(
+    const cv::Point& point,
+    const cv::Point2f& dir, // must be normalized
+    const cv::Mat& directionField, // CV_32FC2
+    cv::Mat& gray, // CV_32F or CV_8U
+    int steps = 4, // how many pixels to sample
+    float valueToAdd = 1.0f,
+    float oppositeThreshold = -0.7f
+);
+
+// propagateIfOppositeMulti at every pixel with the pixel's own direction from directionField, gray ends up the same as
+// after calling it pixel by pixel. the field is normalized once instead of steps times per pixel, the sampling and the
+// opposite test run 4 pixels at a time with sse4.1 when the cpu has it, and every pixel of gray is written once: it
+// counts the neighbors that fire at it and adds that many times, the same sequence of adds the per pixel calls make.
+void PropagateIfOpposite(const cv::Mat& directionField, cv::Mat& gray, int steps = 4, float valueToAdd = 1.0f, float oppositeThreshold = -0.7f);
+
+// the same split into row bands on opencv's thread pool, same result
+void PropagateIfOppositeParallel(const cv::Mat& directionField, cv::Mat& gray, int steps = 4, float valueToAdd = 1.0f,
+    float oppositeThreshold = -0.7f, int bandRows = 32);
@@ -0,0 +1,299 @@
+#include "AutofocusFixedPoint.h"
+#include "AutofocusKernels.h"
+
+using namespace std;
+using namespace cv;
+
+// sum(w * diff) is accumulated as
+// x = (d[left] - d[right]) * 256 + (d[up-left] + d[down-left] - d[up-right] - d[down-right]) * 181
+// y = (d[up] - d[down]) * 256 + (d[up-left] + d[up-right] - d[down-right] - d[down-left]) * 181
+// with d in the same neighbor order as directions / directionsF. x and y are then shifted down by magnitudeShift so
+// their squares fit int32 (|x| <= 765 * (256 + 2 * 181) >> 4 = 29548).
+static const int weightOne = 256;
+static const int weightDiagonal = 181; // 0.7071 in q8
+static const int magnitudeShift = 4;
+static const int neighborDx[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+static const int neighborDy[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+static const int angleBinsPerOctant = 32;
+
+// 0.1 * 255 * cn * 256 >> magnitudeShift, squared
+static int PruneThresholdSquared(int channels)
+{
+    int threshold = 408 * channels;
+    return threshold * threshold;
+}
+
+// encoded (x, y) bytes of an angle bin center
+struct AngleCode { uchar x, y; };
+
+// built once on first use (thread safe static init). constants, an fpu-less target would ship them precomputed.
+struct FixedPointTables
+{
+    int tangents[angleBinsPerOctant + 1]; // tan(k * 45 / 32 degrees) in q15, the bin edges inside one octant
+    AngleCode codes[8 * angleBinsPerOctant]; // [octant << 5 | bin], octant bits: 1 = x < 0, 2 = y < 0, 4 = |y| > |x|
+
+    FixedPointTables()
+    {
+        for (int k = 0; k <= angleBinsPerOctant; k++)
+            tangents[k] = cvRound(tan(k * CV_PI / 4.0 / angleBinsPerOctant) * 32768.0);
+
+        for (int octant = 0; octant < 8; octant++)
+        {
+            for (int bin = 0; bin < angleBinsPerOctant; bin++)
+            {
+                double angle = (bin + 0.5) * CV_PI / 4.0 / angleBinsPerOctant;
+                double major = cos(angle), minor = sin(angle);
+                double x = (octant & 4) ? minor : major;
+                double y = (octant & 4) ? major : minor;
+                if (octant & 1) x = -x;
+                if (octant & 2) y = -y;
+                // same mapping as mapFloatSafe(v, -1, 1, 0, 255)
+                codes[octant * angleBinsPerOctant + bin] = { (uchar)(int)(((float)x + 1.0f) * 255.0f / 2.0f), (uchar)(int)(((float)y + 1.0f) * 255.0f / 2.0f) };
+            }
+        }
+    }
+};
+
+static const FixedPointTables& GetFixedPointTables()
+{
+    static const FixedPointTables tables;
+    return tables;
+}
+
+// pruning, quantization and output of one pixel from its shifted x / y sums
+static inline void StoreFixedPoint(uchar* o, int x, int y, int thresholdSquared, const FixedPointTables& tables)
+{
+    o[2] = 127;
+    if (x * x + y * y < thresholdSquared)
+    {
+        o[0] = 127;
+        o[1] = 127;
+        return;
+    }
+
+    int ax = abs(x), ay = abs(y);
+    int octant = (x < 0 ? 1 : 0) | (y < 0 ? 2 : 0) | (ay > ax ? 4 : 0);
+    int major = max(ax, ay), minor = min(ax, ay);
+
+    // binary search for the last edge with tan(edge) <= minor / major, multiplied out instead of divided
+    int bin = 0;
+    for (int step = angleBinsPerOctant / 2; step > 0; step /= 2)
+    {
+        if (minor * 32768 >= major * tables.tangents[bin + step])
+            bin += step;
+    }
+
+    const AngleCode& code = tables.codes[octant * angleBinsPerOctant + bin];
+    o[0] = code.x;
+    o[1] = code.y;
+}
+
+template<int CN>
+static inline int PixelDiff(const uchar* a, const uchar* b)
+{
+    int diff = 0;
+    for (int c = 0; c < CN; c++)
+        diff += abs(a[c] - b[c]);
+    return diff;
+}
+
+template<int CN>
+static void FixedPointRowScalar(const uchar* prevRow, const uchar* const currRows[3], uchar* outRow, int xBegin, int xEnd)
+{
+    const int thresholdSquared = PruneThresholdSquared(CN);
+    const FixedPointTables& tables = GetFixedPointTables();
+
+    for (int x = xBegin; x < xEnd; x++)
+    {
+        int d[8];
+        for (int k = 0; k < 8; k++)
+            d[k] = PixelDiff<CN>(prevRow + x * CN, currRows[neighborDy[k] + 1] + (x + neighborDx[k]) * CN);
+
+        int sumX = (d[0] - d[4]) * weightOne + (d[1] + d[7] - d[3] - d[5]) * weightDiagonal;
+        int sumY = (d[2] - d[6]) * weightOne + (d[1] + d[3] - d[5] - d[7]) * weightDiagonal;
+        StoreFixedPoint(outRow + x * 3, sumX >> magnitudeShift, sumY >> magnitudeShift, thresholdSquared, tables);
+    }
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AUTOFOCUS_FIXED_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define AUTOFOCUS_FIXED_TARGET(isa) __attribute__((target(isa)))
+#else
+#define AUTOFOCUS_FIXED_TARGET(isa)
+#endif
+
+// channel differences of the 8 pixels starting at own / test as 8 int16 lanes
+template<int CN>
+AUTOFOCUS_FIXED_TARGET("sse4.1")
+static inline __m128i FixedPointDiffSSE41(const uchar* own, const uchar* test)
+{
+    if (CN == 1)
+    {
+        __m128i a = _mm_loadl_epi64((const __m128i*)own), b = _mm_loadl_epi64((const __m128i*)test);
+        return _mm_cvtepu8_epi16(_mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)));
+    }
+
+    // two groups of 4 bgr pixels, each summed per pixel into int32 like the float kernel, then packed to int16
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i onesU8 = _mm_set1_epi8(1), onesI16 = _mm_set1_epi16(1);
+    __m128i groups[2];
+    for (int g = 0; g < 2; g++)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(own + g * 12)), b = _mm_loadu_si128((const __m128i*)(test + g * 12));
+        __m128i absDiff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+        groups[g] = _mm_madd_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(absDiff, spread), onesU8), onesI16);
+    }
+    return _mm_packs_epi32(groups[0], groups[1]);
+}
+
+// 8 pixels per iteration in int16 lanes, twice the pixels per register of the float kernel. the angle quantization
+// at the end is per pixel.
+template<int CN>
+AUTOFOCUS_FIXED_TARGET("sse4.1")
+static int FixedPointRowSSE41(const uchar* prevRow, const uchar* const currRows[3], uchar* outRow, int xBegin, int xEnd, int width)
+{
+    const int thresholdSquared = PruneThresholdSquared(CN);
+    const FixedPointTables& tables = GetFixedPointTables();
+    const __m128i weights = _mm_setr_epi16(weightOne, weightDiagonal, weightOne, weightDiagonal, weightOne, weightDiagonal, weightOne, weightDiagonal);
+
+    int x = xBegin;
+    // widest load starts at pixel x + 1 (8 gray bytes) or x + 5 (16 bgr bytes), keep it inside the row
+    int last = min(xEnd - 8, CN == 1 ? width - 9 : width - 11);
+    for (; x <= last; x += 8)
+    {
+        __m128i d[8];
+        for (int k = 0; k < 8; k++)
+            d[k] = FixedPointDiffSSE41<CN>(prevRow + x * CN, currRows[neighborDy[k] + 1] + (x + neighborDx[k]) * CN);
+
+        __m128i straightX = _mm_sub_epi16(d[0], d[4]);
+        __m128i diagonalX = _mm_sub_epi16(_mm_add_epi16(d[1], d[7]), _mm_add_epi16(d[3], d[5]));
+        __m128i straightY = _mm_sub_epi16(d[2], d[6]);
+        __m128i diagonalY = _mm_sub_epi16(_mm_add_epi16(d[1], d[3]), _mm_add_epi16(d[5], d[7]));
+
+        // straight * 256 + diagonal * 181 as one madd per 4 pixels
+        int sums[2][8];
+        _mm_storeu_si128((__m128i*)sums[0], _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(straightX, diagonalX), weights), magnitudeShift));
+        _mm_storeu_si128((__m128i*)(sums[0] + 4), _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(straightX, diagonalX), weights), magnitudeShift));
+        _mm_storeu_si128((__m128i*)sums[1], _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(straightY, diagonalY), weights), magnitudeShift));
+        _mm_storeu_si128((__m128i*)(sums[1] + 4), _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(straightY, diagonalY), weights), magnitudeShift));
+
+        for (int i = 0; i < 8; i++)
+            StoreFixedPoint(outRow + (x + i) * 3, sums[0][i], sums[1][i], thresholdSquared, tables);
+    }
+    return x;
+}
+#endif
+
+template<int CN>
+static void FixedPointRows(const Mat& prev, const Mat& curr, Mat& out, int yBegin, int yEnd)
+{
+#ifdef AUTOFOCUS_FIXED_X86
+    static const bool useSSE41 = checkHardwareSupport(CV_CPU_SSE4_1);
+#endif
+
+    for (int y = yBegin; y < yEnd; y++)
+    {
+        const uchar* currRows[3] = { curr.ptr<uchar>(y - 1), curr.ptr<uchar>(y), curr.ptr<uchar>(y + 1) };
+        const uchar* prevRow = prev.ptr<uchar>(y);
+        uchar* outRow = out.ptr<uchar>(y);
+
+        int x = 1;
+#ifdef AUTOFOCUS_FIXED_X86
+        if (useSSE41)
+            x = FixedPointRowSSE41<CN>(prevRow, currRows, outRow, 1, prev.cols - 1, prev.cols);
+#endif
+        FixedPointRowScalar<CN>(prevRow, currRows, outRow, x, prev.cols - 1);
+    }
+}
+
+static void FixedPointRows(const Mat& prev, const Mat& curr, Mat& out, int yBegin, int yEnd)
+{
+    if (prev.channels() == 1)
+        FixedPointRows<1>(prev, curr, out, yBegin, yEnd);
+    else
+        FixedPointRows<3>(prev, curr, out, yBegin, yEnd);
+}
+
+static void CheckFixedPointArguments(const Mat& prev, const Mat& curr, const Mat& out)
+{
+    CV_Assert((prev.type() == CV_8UC1 || prev.type() == CV_8UC3) && curr.type() == prev.type());
+    CV_Assert(out.type() == CV_8UC3 && prev.size() == curr.size() && prev.size() == out.size());
+}
+
+void GetStimuliFixedPoint(const Mat& prev, const Mat& curr, Mat& out)
+{
+    CheckFixedPointArguments(prev, curr, out);
+    FixedPointRows(prev, curr, out, 1, prev.rows - 1);
+}
+
+class FixedPointBandBody : public ParallelLoopBody
+{
+public:
+    FixedPointBandBody(const Mat& prev, const Mat& curr, Mat& out, int bandRows) : prev(prev), curr(curr), out(out), bandRows(bandRows) {}
+
+    void operator()(const Range& bands) const override
+    {
+        FixedPointRows(prev, curr, out, 1 + bands.start * bandRows, min(prev.rows - 1, 1 + bands.end * bandRows));
+    }
+
+private:
+    const Mat& prev;
+    const Mat& curr;
+    Mat& out;
+    int bandRows;
+};
+
+void GetStimuliFixedPointParallel(const Mat& prev, const Mat& curr, Mat& out, int bandRows)
+{
+    CheckFixedPointArguments(prev, curr, out);
+    CV_Assert(bandRows > 0);
+
+    int bandCount = (prev.rows - 2 + bandRows - 1) / bandRows;
+    if (bandCount <= 0)
+        return;
+
+    // same banding as GetStimuliParallel, each band only writes its own rows
+    parallel_for_(Range(0, bandCount), FixedPointBandBody(prev, curr, out, bandRows), bandCount);
+}
+
+FixedPointError MeasureFixedPointError(const Mat& prev, const Mat& curr)
+{
+    Mat floatOut(prev.size(), CV_8UC3, Scalar(0, 0, 0));
+    Mat fixedOut(prev.size(), CV_8UC3, Scalar(0, 0, 0));
+    GetStimuli(prev, curr, floatOut);
+    GetStimuliFixedPoint(prev, curr, fixedOut);
+
+    FixedPointError error;
+    long long errorSum = 0, activeBoth = 0;
+    for (int y = 1; y < prev.rows - 1; y++)
+    {
+        const Vec3b* a = floatOut.ptr<Vec3b>(y);
+        const Vec3b* b = fixedOut.ptr<Vec3b>(y);
+        for (int x = 1; x < prev.cols - 1; x++)
+        {
+            error.comparedPixels++;
+            bool activeA = a[x][0] != 127 || a[x][1] != 127;
+            bool activeB = b[x][0] != 127 || b[x][1] != 127;
+            if (activeA != activeB)
+            {
+                error.pruneMismatches++;
+                continue;
+            }
+            if (!activeA)
+                continue;
+
+            for (int c = 0; c < 2; c++)
+            {
+                int e = abs(a[x][c] - b[x][c]);
+                error.maxByteError = max(error.maxByteError, e);
+                errorSum += e;
+            }
+            activeBoth += 2;
+        }
+    }
+    error.meanByteError = activeBoth ? (double)errorSum / activeBoth : 0.0;
+    return error;
+}
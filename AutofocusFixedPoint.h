@@ -0,0 +1,30 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+// integer-only version of GetStimuli for cores without an fpu (and for more lanes per simd register).
+// same inputs (CV_8UC1 / CV_8UC3 levels) and the same CV_8UC3 visual output as GetStimuli, computed like this:
+// * the 8 direction weights sum to zero, so sum(w * (765 - diff)) == -sum(w * diff) and the kernel works on the raw
+//   integer channel differences, in int16 lanes.
+// * weights are q8 (1 -> 256, 0.7071 -> 181).
+// * the 0.1 pruning threshold is an integer compare on the squared magnitude, scaled down by 16 to stay in int32.
+// * the direction is quantized to one of 256 angle bins by comparisons against a tangent table (no division, no sqrt)
+//   and the output bytes come from a table of bin centers.
+// error against the float kernel: bins are 1.4 degrees wide, so the angle is off by at most ~0.7 degrees plus the
+// weight rounding (0.01%), which moves each output byte by at most 2. pixels whose magnitude sits right on the pruning
+// threshold can flip between pruned and not. MeasureFixedPointError reports the measured numbers for a level pair.
+void GetStimuliFixedPoint(const cv::Mat& prev, const cv::Mat& curr, cv::Mat& out);
+
+// row bands on opencv's thread pool like GetStimuliParallel, identical output to GetStimuliFixedPoint.
+void GetStimuliFixedPointParallel(const cv::Mat& prev, const cv::Mat& curr, cv::Mat& out, int bandRows = 32);
+
+struct FixedPointError
+{
+    int maxByteError = 0; // largest difference of an x / y output byte on pixels active in both
+    double meanByteError = 0.0;
+    long long pruneMismatches = 0; // pixels pruned by one kernel but not the other
+    long long comparedPixels = 0;
+};
+
+// runs both kernels on one level pair and compares them.
+FixedPointError MeasureFixedPointError(const cv::Mat& prev, const cv::Mat& curr);
@@ -0,0 +1,160 @@
+#include "AutofocusImpulses.h"
+#include "AutofocusCommon.h"
+
+using namespace std;
+using namespace cv;
+
+// planar copies of the field around output row y, the interleaved x, y, magnitude triplets do not vectorize
+struct ImpulseRows
+{
+    const float* magnitude[3]; // rows y - 1, y, y + 1
+    const float* dx;
+    const float* dy;
+};
+
+static inline void AddImpulse(const ImpulseRows& rows, int x, int y, uchar code, vector<DirectionImpulse>& out)
+{
+    DirectionImpulse impulse;
+    impulse.x = x;
+    impulse.y = y;
+    impulse.direction = Point2f(rows.dx[x], rows.dy[x]);
+    impulse.magnitude = rows.magnitude[1][x];
+    impulse.sector = code - 1;
+    out.push_back(impulse);
+}
+
+static void ImpulseRowScalar(const ImpulseRows& rows, int y, int xBegin, int xEnd, float minMagnitude, vector<DirectionImpulse>& out)
+{
+    for (int x = xBegin; x < xEnd; x++)
+    {
+        float m = rows.magnitude[1][x];
+        uchar code = DirectionCode(rows.dx[x], rows.dy[x]);
+        if (code == 0 || m < minMagnitude)
+            continue;
+
+        const Point& d = directions[code - 1];
+        float forward = rows.magnitude[1 + d.y][x + d.x];
+        float backward = rows.magnitude[1 - d.y][x - d.x];
+        if (m > forward && m >= backward)
+            AddImpulse(rows, x, y, code, out);
+    }
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AUTOFOCUS_IMPULSE_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define AUTOFOCUS_IMPULSE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define AUTOFOCUS_IMPULSE_TARGET(isa)
+#endif
+
+// 4 pixels per iteration. the forward / backward neighbors of all 4 sector pairs are loaded and the right ones picked
+// per lane with the same comparisons DirectionCode makes, so only the survivors are looked at one by one.
+AUTOFOCUS_IMPULSE_TARGET("sse4.1")
+static int ImpulseRowSSE41(const ImpulseRows& rows, int y, int xBegin, int xEnd, float minMagnitude, vector<DirectionImpulse>& out)
+{
+    const __m128 zero = _mm_setzero_ps(), tan225 = _mm_set1_ps(0.41421356f), minimum = _mm_set1_ps(minMagnitude);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const float* up = rows.magnitude[0];
+    const float* mid = rows.magnitude[1];
+    const float* down = rows.magnitude[2];
+
+    int x = xBegin;
+    for (; x <= xEnd - 4; x += 4)
+    {
+        __m128 m = _mm_loadu_ps(mid + x);
+        __m128 dirX = _mm_loadu_ps(rows.dx + x), dirY = _mm_loadu_ps(rows.dy + x);
+        __m128 ax = _mm_and_ps(dirX, absMask), ay = _mm_and_ps(dirY, absMask);
+        __m128 left = _mm_cmplt_ps(dirX, zero), above = _mm_cmplt_ps(dirY, zero);
+
+        __m128 mLeft = _mm_loadu_ps(mid + x - 1), mRight = _mm_loadu_ps(mid + x + 1);
+        __m128 mUp = _mm_loadu_ps(up + x), mDown = _mm_loadu_ps(down + x);
+        __m128 mUpLeft = _mm_loadu_ps(up + x - 1), mUpRight = _mm_loadu_ps(up + x + 1);
+        __m128 mDownLeft = _mm_loadu_ps(down + x - 1), mDownRight = _mm_loadu_ps(down + x + 1);
+
+        // x is never 0 on the diagonals, so x < 0 decides both diagonal halves like in DirectionCode
+        __m128 horizontalForward = _mm_blendv_ps(mRight, mLeft, left), horizontalBackward = _mm_blendv_ps(mLeft, mRight, left);
+        __m128 verticalForward = _mm_blendv_ps(mDown, mUp, above), verticalBackward = _mm_blendv_ps(mUp, mDown, above);
+        __m128 diagonalForward = _mm_blendv_ps(_mm_blendv_ps(mDownRight, mDownLeft, left), _mm_blendv_ps(mUpRight, mUpLeft, left), above);
+        __m128 diagonalBackward = _mm_blendv_ps(_mm_blendv_ps(mUpLeft, mUpRight, left), _mm_blendv_ps(mDownLeft, mDownRight, left), above);
+
+        __m128 horizontal = _mm_cmple_ps(ay, _mm_mul_ps(tan225, ax)), vertical = _mm_cmple_ps(ax, _mm_mul_ps(tan225, ay));
+        __m128 forward = _mm_blendv_ps(_mm_blendv_ps(diagonalForward, verticalForward, vertical), horizontalForward, horizontal);
+        __m128 backward = _mm_blendv_ps(_mm_blendv_ps(diagonalBackward, verticalBackward, vertical), horizontalBackward, horizontal);
+
+        // magnitude is 0 without a direction, so m > forward also drops those
+        __m128 keep = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(m, forward), _mm_cmpge_ps(m, backward)), _mm_cmpge_ps(m, minimum));
+        int mask = _mm_movemask_ps(keep);
+        if (!mask)
+            continue;
+        for (int lane = 0; lane < 4; lane++)
+        {
+            if (mask & (1 << lane))
+                AddImpulse(rows, x + lane, y, DirectionCode(rows.dx[x + lane], rows.dy[x + lane]), out);
+        }
+    }
+    return x;
+}
+#endif
+
+void ExtractImpulses(const Mat& field, float minMagnitude, DirectionImpulses& result)
+{
+    CV_Assert(field.type() == CV_32FC3);
+#ifdef AUTOFOCUS_IMPULSE_X86
+    static const bool useSSE41 = checkHardwareSupport(CV_CPU_SSE4_1);
+#endif
+
+    int cols = field.cols;
+    result.rowOrder.clear();
+    result.impulses.clear();
+    result.columnStart.assign(cols + 1, 0);
+    if (field.rows < 3 || cols < 3)
+        return;
+
+    // three magnitude rows that rotate as y advances, plus the direction of the middle one
+    result.planes.resize(cols * 5);
+    float* magnitudePlanes[3] = { &result.planes[0], &result.planes[cols], &result.planes[cols * 2] };
+    float* dxPlane = &result.planes[cols * 3];
+    float* dyPlane = &result.planes[cols * 4];
+    auto splitMagnitude = [&](int y, float* magnitude)
+    {
+        const float* in = field.ptr<float>(y);
+        for (int x = 0; x < cols; x++)
+            magnitude[x] = in[x * 3 + 2];
+    };
+    splitMagnitude(0, magnitudePlanes[0]);
+    splitMagnitude(1, magnitudePlanes[1]);
+
+    for (int y = 1; y < field.rows - 1; y++)
+    {
+        splitMagnitude(y + 1, magnitudePlanes[2]);
+        const float* in = field.ptr<float>(y);
+        for (int x = 0; x < cols; x++)
+        {
+            dxPlane[x] = in[x * 3];
+            dyPlane[x] = in[x * 3 + 1];
+        }
+
+        ImpulseRows rows = { { magnitudePlanes[0], magnitudePlanes[1], magnitudePlanes[2] }, dxPlane, dyPlane };
+        int x = 1;
+#ifdef AUTOFOCUS_IMPULSE_X86
+        if (useSSE41)
+            x = ImpulseRowSSE41(rows, y, 1, cols - 1, minMagnitude, result.rowOrder);
+#endif
+        ImpulseRowScalar(rows, y, x, cols - 1, minMagnitude, result.rowOrder);
+
+        rotate(magnitudePlanes, magnitudePlanes + 1, magnitudePlanes + 3);
+    }
+
+    // counting sort by column. rowOrder is sorted by y, so every column stays sorted by y.
+    for (const DirectionImpulse& impulse : result.rowOrder)
+        result.columnStart[impulse.x + 1]++;
+    for (int x = 0; x < cols; x++)
+        result.columnStart[x + 1] += result.columnStart[x];
+
+    result.impulses.resize(result.rowOrder.size());
+    result.columnFill.assign(result.columnStart.begin(), result.columnStart.end() - 1);
+    for (const DirectionImpulse& impulse : result.rowOrder)
+        result.impulses[result.columnFill[impulse.x]++] = impulse;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// sparse stage between GetStimuli and the impulse consumers (impulse.cpp, memorytest2.cpp, opencv_contexts.cpp, ...).
+// instead of every consumer rescanning a dense image pixel by pixel, the direction field is thinned once by non maximum
+// suppression along each pixel's direction and the survivors are listed column by column, the order those consumers
+// walk the image in. everything after the extraction scales with the number of impulses instead of the pixel count.
+
+struct DirectionImpulse
+{
+    int x, y;
+    cv::Point2f direction; // normalized, as GetStimuli wrote it
+    float magnitude; // length of the direction before it was normalized, the strength of the stimulus
+    uchar sector; // 0..7, the directions[] neighbor the direction is closest to, like the packed map
+};
+
+struct DirectionImpulses
+{
+    std::vector<DirectionImpulse> impulses; // sorted by x, then y
+    std::vector<int> columnStart; // column x is impulses[columnStart[x]] .. impulses[columnStart[x + 1] - 1]
+
+    // scratch, kept so extracting the next frame does not allocate
+    std::vector<DirectionImpulse> rowOrder;
+    std::vector<float> planes;
+    std::vector<int> columnFill;
+
+    size_t columnSize(int x) const { return columnStart[x + 1] - columnStart[x]; }
+    const DirectionImpulse* columnBegin(int x) const { return impulses.data() + columnStart[x]; }
+    const DirectionImpulse* columnEnd(int x) const { return impulses.data() + columnStart[x + 1]; }
+};
+
+// field is the CV_32FC3 output of GetStimuli (direction and magnitude). an interior pixel becomes an impulse if its
+// magnitude is at least minMagnitude and it is a maximum along its sector: above the neighbor its direction points to
+// and not below the one behind it, so a plateau along the direction gives one impulse instead of none.
+// the row pass runs 4 pixels at a time with sse4.1 when the cpu has it, the scalar fallback gives the same list.
+void ExtractImpulses(const cv::Mat& field, float minMagnitude, DirectionImpulses& result);
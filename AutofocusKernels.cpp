@@ -0,0 +1,841 @@
+#include "AutofocusKernels.h"
+#include "AutofocusCommon.h"
+#include <iostream>
+
+using namespace std;
+using namespace cv;
+
+// original per pixel version of the algorithm. kept as the reference the fast kernels below are checked against.
+void GetStimuliReference(const Mat& prev, const Mat& curr, Mat& out)
+{
+    for (int i = 1; i < prev.cols - 1; i++)
+    {
+        for (int j = 1; j < prev.rows - 1; j++)
+        {
+            Point2f dir(0.0f, 0.0f);
+            const Vec3b& ownValue = prev.at<Vec3b>(j, i); // save previous value at pixel
+            for (int k = 0; k < 8; k++) // compare to current values of neighbors to detect motion
+            {
+                const Vec3b& testValue = curr.at<Vec3b>(j + directions[k].y, i + directions[k].x);
+                float similarity = similarityL1(ownValue, testValue);
+                dir += directionsF[k] * similarity; // similar neighbor means point of interest shifted towards here.
+            }
+            dir = normalize(dir);
+            out.at<Vec3b>(j, i) = Vec3b((int)mapFloatSafe(dir.x, -1.0f, 1.0f, 0.0f, 255.0f), (int)mapFloatSafe(dir.y, -1.0f, 1.0f, 0.0f, 255.0f), 127);
+        }
+    }
+}
+
+// fast version of the same kernel. walks the image row by row with raw row pointers and picks an avx2 / sse4.1 / scalar
+// row function at runtime. all paths do the exact same float operations in the exact same order as GetStimuliReference
+// (neighbors are accumulated left, up-left, up, ... like directionsF, terms with a 0 weight are skipped since adding +0
+// never changes the sum), so the output is bit-for-bit identical. only requirement is that the reference is not compiled
+// with fused multiply-add contraction (msvc /fp:precise default, or -ffp-contract=off on gcc/clang).
+
+// stencils are template parameters of every kernel below, so the tap count, the offsets and the weights are compile
+// time constants: the loops over the taps unroll, the row pointers become fixed offsets and the zero weight checks fold
+// away. each StimuliStencil is its own set of instantiations, picked at runtime through stimuliRowsTable.
+// all of them start at the left neighbor and go clockwise, weights are the unit vector towards the tap.
+template<int Taps>
+struct StencilTaps;
+
+// the original stencil, same values and order as directions / directionsF
+template<>
+struct StencilTaps<8>
+{
+    static const int count = 8, radius = 1;
+    static const int dx[8], dy[8];
+    static const float wx[8], wy[8];
+};
+const int StencilTaps<8>::dx[8] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+const int StencilTaps<8>::dy[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+const float StencilTaps<8>::wx[8] = { -1.0f, -0.7071f, 0.0f, 0.7071f, 1.0f, 0.7071f, 0.0f, -0.7071f };
+const float StencilTaps<8>::wy[8] = { 0.0f, -0.7071f, -1.0f, -0.7071f, 0.0f, 0.7071f, 1.0f, 0.7071f };
+
+// left, up, right, down only
+template<>
+struct StencilTaps<4>
+{
+    static const int count = 4, radius = 1;
+    static const int dx[4], dy[4];
+    static const float wx[4], wy[4];
+};
+const int StencilTaps<4>::dx[4] = { -1, 0, 1, 0 };
+const int StencilTaps<4>::dy[4] = { 0, -1, 0, 1 };
+const float StencilTaps<4>::wx[4] = { -1.0f, 0.0f, 1.0f, 0.0f };
+const float StencilTaps<4>::wy[4] = { 0.0f, -1.0f, 0.0f, 1.0f };
+
+// border of the 5x5 window, for twice the motion per level
+template<>
+struct StencilTaps<16>
+{
+    static const int count = 16, radius = 2;
+    static const int dx[16], dy[16];
+    static const float wx[16], wy[16];
+};
+const int StencilTaps<16>::dx[16] = { -2, -2, -2, -1, 0, 1, 2, 2, 2, 2, 2, 1, 0, -1, -2, -2 };
+const int StencilTaps<16>::dy[16] = { 0, -1, -2, -2, -2, -2, -2, -1, 0, 1, 2, 2, 2, 2, 2, 1 };
+const float StencilTaps<16>::wx[16] = { -1.0f, -0.8944f, -0.7071f, -0.4472f, 0.0f, 0.4472f, 0.7071f, 0.8944f, 1.0f, 0.8944f, 0.7071f, 0.4472f, 0.0f, -0.4472f, -0.7071f, -0.8944f };
+const float StencilTaps<16>::wy[16] = { 0.0f, -0.4472f, -0.7071f, -0.8944f, -1.0f, -0.8944f, -0.7071f, -0.4472f, 0.0f, 0.4472f, 0.7071f, 0.8944f, 1.0f, 0.8944f, 0.7071f, 0.4472f };
+
+// border of the 7x7 window
+template<>
+struct StencilTaps<24>
+{
+    static const int count = 24, radius = 3;
+    static const int dx[24], dy[24];
+    static const float wx[24], wy[24];
+};
+const int StencilTaps<24>::dx[24] = { -3, -3, -3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 3, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3 };
+const int StencilTaps<24>::dy[24] = { 0, -1, -2, -3, -3, -3, -3, -3, -3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 3, 3, 3, 3, 2, 1 };
+const float StencilTaps<24>::wx[24] = { -1.0f, -0.9487f, -0.8321f, -0.7071f, -0.5547f, -0.3162f, 0.0f, 0.3162f, 0.5547f, 0.7071f, 0.8321f, 0.9487f,
+    1.0f, 0.9487f, 0.8321f, 0.7071f, 0.5547f, 0.3162f, 0.0f, -0.3162f, -0.5547f, -0.7071f, -0.8321f, -0.9487f };
+const float StencilTaps<24>::wy[24] = { 0.0f, -0.3162f, -0.5547f, -0.7071f, -0.8321f, -0.9487f, -1.0f, -0.9487f, -0.8321f, -0.7071f, -0.5547f, -0.3162f,
+    0.0f, 0.3162f, 0.5547f, 0.7071f, 0.8321f, 0.9487f, 1.0f, 0.9487f, 0.8321f, 0.7071f, 0.5547f, 0.3162f };
+
+// what the row functions write per pixel
+enum StimuliOutput
+{
+    OutputEncoded, // CV_8UC3, mapFloatSafe'd x / y plus 127, the original visual format
+    OutputField, // CV_32FC2, the normalized direction itself
+    OutputPacked, // CV_8UC1, a nibble per pixel, see PackedDirectionMapSize
+    OutputFieldMagnitude, // CV_32FC3, the normalized direction and its length before normalizing
+    OutputCount
+};
+
+// nibble of the packed format, 8 | (code - 1) for a direction, 0 for none
+static inline uchar PackedNibble(float x, float y)
+{
+    uchar code = DirectionCode(x, y);
+    return code ? code + 7 : 0;
+}
+
+// processes pixels [xBegin, xEnd) of one row (radius <= xBegin, xEnd <= width - radius) and returns the first x it did
+// not get to, the scalar row function finishes the rest. currRows[radius + dy] is the curr row dy below the output row.
+typedef int (*StimuliRowFunc)(const uchar* prevRow, const uchar* const* currRows, uchar* outRow, int xBegin, int xEnd, int width);
+
+// magnitude is only stored by OutputFieldMagnitude
+template<int Output>
+static inline void StoreStimuli(uchar* outRow, int x, const Point2f& dir, float magnitude)
+{
+    if (Output == OutputFieldMagnitude)
+    {
+        float* o = (float*)outRow + x * 3;
+        o[0] = dir.x;
+        o[1] = dir.y;
+        o[2] = magnitude;
+    }
+    else if (Output == OutputPacked)
+    {
+        // the other pixel of the byte is kept, it can be outside the range being written
+        uchar nibble = PackedNibble(dir.x, dir.y);
+        uchar& pair = outRow[x >> 1];
+        pair = x & 1 ? (uchar)((pair & 0x0F) | (nibble << 4)) : (uchar)((pair & 0xF0) | nibble);
+    }
+    else if (Output == OutputField)
+    {
+        float* o = (float*)outRow + x * 2;
+        o[0] = dir.x;
+        o[1] = dir.y;
+    }
+    else
+    {
+        uchar* o = outRow + x * 3;
+        o[0] = (uchar)(int)mapFloatSafe(dir.x, -1.0f, 1.0f, 0.0f, 255.0f);
+        o[1] = (uchar)(int)mapFloatSafe(dir.y, -1.0f, 1.0f, 0.0f, 255.0f);
+        o[2] = 127;
+    }
+}
+
+// scalar fallback, also used for the leftover pixels at the end of each row. CN is the input channel count.
+template<class Stencil, int CN, int Output>
+static void GetStimuliRowScalar(const uchar* prevRow, const uchar* const* currRows, uchar* outRow, int xBegin, int xEnd)
+{
+    typedef Vec<uchar, CN> Pixel;
+    const Pixel* prevPixels = (const Pixel*)prevRow;
+
+    for (int x = xBegin; x < xEnd; x++)
+    {
+        Point2f dir(0.0f, 0.0f);
+        for (int k = 0; k < Stencil::count; k++)
+        {
+            const Pixel* testRow = (const Pixel*)currRows[Stencil::radius + Stencil::dy[k]];
+            float similarity = similarityL1<CN>(prevPixels[x], testRow[x + Stencil::dx[k]]);
+            dir.x += Stencil::wx[k] * similarity;
+            dir.y += Stencil::wy[k] * similarity;
+        }
+        float length = std::sqrt(dir.x * dir.x + dir.y * dir.y); // what normalize() divides by, 0 where it prunes
+        StoreStimuli<Output>(outRow, x, normalize(dir), length < 0.1f ? 0.0f : length);
+    }
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AUTOFOCUS_X86 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define AUTOFOCUS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define AUTOFOCUS_TARGET(isa) // msvc lets us use every intrinsic without flags
+#endif
+
+// raw bytes of the 4 pixels starting at p: 16 bytes for bgr (12 used), 4 bytes for gray
+template<int CN>
+AUTOFOCUS_TARGET("sse4.1")
+static inline __m128i StimuliLoadSSE41(const uchar* p)
+{
+    if (CN == 1)
+    {
+        int bytes;
+        memcpy(&bytes, p, 4);
+        return _mm_cvtsi32_si128(bytes);
+    }
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+// l1 difference of 4 pixels as int32
+template<int CN>
+AUTOFOCUS_TARGET("sse4.1")
+static inline __m128i StimuliDiffSSE41(__m128i own, __m128i test)
+{
+    __m128i absDiff = _mm_or_si128(_mm_subs_epu8(own, test), _mm_subs_epu8(test, own));
+    if (CN == 1)
+        return _mm_cvtepu8_epi32(absDiff);
+
+    // gathers the 3 channels of each pixel into its own 32 bit lane, 4th byte zeroed, then sums them
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    return _mm_madd_epi16(_mm_maddubs_epi16(_mm_shuffle_epi8(absDiff, spread), _mm_set1_epi8(1)), _mm_set1_epi16(1));
+}
+
+// normalized direction of the 4 pixels starting at x, zero where normalize() prunes.
+template<class Stencil, int CN>
+AUTOFOCUS_TARGET("sse4.1")
+static inline void StimuliDirectionSSE41(const uchar* prevRow, const uchar* const* currRows, int x, __m128& dirX, __m128& dirY, __m128& magnitude)
+{
+    const __m128 one = _mm_set1_ps(1.0f), maxDiff = _mm_set1_ps(255.0f * CN), minLength = _mm_set1_ps(0.1f);
+
+    __m128i own = StimuliLoadSSE41<CN>(prevRow + x * CN);
+    dirX = _mm_setzero_ps();
+    dirY = _mm_setzero_ps();
+    for (int k = 0; k < Stencil::count; k++)
+    {
+        __m128i test = StimuliLoadSSE41<CN>(currRows[Stencil::radius + Stencil::dy[k]] + (x + Stencil::dx[k]) * CN);
+        __m128 similarity = _mm_sub_ps(one, _mm_div_ps(_mm_cvtepi32_ps(StimuliDiffSSE41<CN>(own, test)), maxDiff));
+        if (Stencil::wx[k] != 0.0f)
+            dirX = _mm_add_ps(dirX, _mm_mul_ps(_mm_set1_ps(Stencil::wx[k]), similarity));
+        if (Stencil::wy[k] != 0.0f)
+            dirY = _mm_add_ps(dirY, _mm_mul_ps(_mm_set1_ps(Stencil::wy[k]), similarity));
+    }
+
+    __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dirX, dirX), _mm_mul_ps(dirY, dirY)));
+    __m128 keep = _mm_cmpge_ps(length, minLength); // normalize() pruning, false for nan as well
+    dirX = _mm_and_ps(_mm_div_ps(dirX, length), keep);
+    dirY = _mm_and_ps(_mm_div_ps(dirY, length), keep);
+    magnitude = _mm_and_ps(length, keep);
+}
+
+// x, y, magnitude triplets of 4 pixels, exactly 12 floats. after the transpose a..d are the pixels as x y m 0, the 0
+// of each one is overwritten by the next store and the last pixel is stored without it.
+AUTOFOCUS_TARGET("sse4.1")
+static inline void StoreFieldMagnitudeSSE41(float* o, __m128 dirX, __m128 dirY, __m128 magnitude)
+{
+    __m128 a = dirX, b = dirY, c = magnitude, d = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _mm_storeu_ps(o, a);
+    _mm_storeu_ps(o + 3, b);
+    _mm_storeu_ps(o + 6, c);
+    _mm_storel_pi((__m64*)(o + 9), d);
+    _mm_store_ss(o + 11, _mm_movehl_ps(d, d));
+}
+
+// PackedNibble of 4 directions as int32, the same comparisons as DirectionCode on the same floats.
+AUTOFOCUS_TARGET("sse4.1")
+static inline __m128i StimuliPackedNibblesSSE41(__m128 dirX, __m128 dirY)
+{
+    const __m128 zero = _mm_setzero_ps(), tan225 = _mm_set1_ps(0.41421356f);
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 ax = _mm_and_ps(dirX, absMask), ay = _mm_and_ps(dirY, absMask);
+    __m128 left = _mm_cmplt_ps(dirX, zero), up = _mm_cmplt_ps(dirY, zero);
+
+    // x is never 0 on the diagonals, so x < 0 decides both diagonal halves
+    __m128 horizontal = _mm_blendv_ps(_mm_set1_ps(12.0f), _mm_set1_ps(8.0f), left);
+    __m128 vertical = _mm_blendv_ps(_mm_set1_ps(14.0f), _mm_set1_ps(10.0f), up);
+    __m128 diagonal = _mm_blendv_ps(_mm_blendv_ps(_mm_set1_ps(13.0f), _mm_set1_ps(15.0f), left), _mm_blendv_ps(_mm_set1_ps(11.0f), _mm_set1_ps(9.0f), left), up);
+    __m128 nibble = _mm_blendv_ps(diagonal, vertical, _mm_cmple_ps(ax, _mm_mul_ps(tan225, ay)));
+    nibble = _mm_blendv_ps(nibble, horizontal, _mm_cmple_ps(ay, _mm_mul_ps(tan225, ax)));
+
+    __m128 none = _mm_and_ps(_mm_cmpeq_ps(ax, zero), _mm_cmpeq_ps(ay, zero));
+    return _mm_cvttps_epi32(_mm_andnot_ps(none, nibble));
+}
+
+// nibble bytes c0 c1 c2 c3 .. to the packed bytes c0 | c1 << 4, c2 | c3 << 4 ..
+AUTOFOCUS_TARGET("sse4.1")
+static inline __m128i StimuliPackNibblesSSE41(__m128i nibbleBytes)
+{
+    return _mm_packus_epi16(_mm_maddubs_epi16(nibbleBytes, _mm_set1_epi16(0x1001)), _mm_setzero_si128());
+}
+
+// 4 pixels per iteration. packed output needs an even xBegin, every block then fills 2 whole bytes.
+template<class Stencil, int CN, int Output>
+AUTOFOCUS_TARGET("sse4.1")
+static int GetStimuliRowSSE41(const uchar* prevRow, const uchar* const* currRows, uchar* outRow, int xBegin, int xEnd, int width)
+{
+    // x bytes 0..3 and y bytes 4..7 back to interleaved b, g, (127) triplets
+    const __m128i interleave = _mm_setr_epi8(0, 4, -1, 1, 5, -1, 2, 6, -1, 3, 7, -1, -1, -1, -1, -1);
+    const __m128i fill = _mm_setr_epi8(0, 0, 127, 0, 0, 127, 0, 0, 127, 0, 0, 127, 0, 0, 0, 0);
+    const __m128 one = _mm_set1_ps(1.0f), outScale = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+
+    int x = xBegin;
+    // widest load starts at pixel x + radius (16 bytes for bgr, 4 for gray), keep it inside the row
+    int last = min(xEnd - 4, (CN == 1 ? width - 4 : width - 6) - Stencil::radius);
+    for (; x <= last; x += 4)
+    {
+        __m128 dirX, dirY, magnitude;
+        StimuliDirectionSSE41<Stencil, CN>(prevRow, currRows, x, dirX, dirY, magnitude);
+
+        if (Output == OutputFieldMagnitude)
+        {
+            StoreFieldMagnitudeSSE41((float*)outRow + x * 3, dirX, dirY, magnitude);
+            continue;
+        }
+        if (Output == OutputPacked)
+        {
+            __m128i nibbles = _mm_packus_epi16(_mm_packus_epi32(StimuliPackedNibblesSSE41(dirX, dirY), _mm_setzero_si128()), _mm_setzero_si128());
+            uint16_t pairs = (uint16_t)_mm_extract_epi16(StimuliPackNibblesSSE41(nibbles), 0);
+            memcpy(outRow + x / 2, &pairs, 2);
+            continue;
+        }
+        if (Output == OutputField)
+        {
+            float* o = (float*)outRow + x * 2;
+            _mm_storeu_ps(o, _mm_unpacklo_ps(dirX, dirY));
+            _mm_storeu_ps(o + 4, _mm_unpackhi_ps(dirX, dirY));
+            continue;
+        }
+
+        // mapFloatSafe(v, -1, 1, 0, 255) == (v + 1) * 255 / 2, the / 2 is exact as * 0.5
+        __m128i mappedX = _mm_cvttps_epi32(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(dirX, one), outScale), half));
+        __m128i mappedY = _mm_cvttps_epi32(_mm_mul_ps(_mm_mul_ps(_mm_add_ps(dirY, one), outScale), half));
+        __m128i packed = _mm_packus_epi16(_mm_packus_epi32(mappedX, mappedY), _mm_setzero_si128());
+        __m128i result = _mm_or_si128(_mm_shuffle_epi8(packed, interleave), fill);
+
+        // exactly 12 bytes, the pixel after this block must not be touched
+        _mm_storel_epi64((__m128i*)(outRow + x * 3), result);
+        int tail = _mm_extract_epi32(result, 2);
+        memcpy(outRow + x * 3 + 8, &tail, 4);
+    }
+    return x;
+}
+
+// raw bytes of the 8 pixels starting at p, pixels 0..3 in the low lane and 4..7 in the high lane for bgr. gray keeps
+// all 8 bytes in the low half, they are widened to 8 lanes in StimuliDiffAVX2.
+template<int CN>
+AUTOFOCUS_TARGET("avx2")
+static inline __m256i StimuliLoadAVX2(const uchar* p)
+{
+    if (CN == 1)
+        return _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i*)p));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)), _mm_loadu_si128((const __m128i*)(p + 12)), 1);
+}
+
+template<int CN>
+AUTOFOCUS_TARGET("avx2")
+static inline __m256i StimuliDiffAVX2(__m256i own, __m256i test)
+{
+    if (CN == 1)
+    {
+        __m128i a = _mm256_castsi256_si128(own), b = _mm256_castsi256_si128(test);
+        return _mm256_cvtepu8_epi32(_mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a)));
+    }
+
+    const __m256i spread = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m256i absDiff = _mm256_or_si256(_mm256_subs_epu8(own, test), _mm256_subs_epu8(test, own));
+    return _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_shuffle_epi8(absDiff, spread), _mm256_set1_epi8(1)), _mm256_set1_epi16(1));
+}
+
+// same as StimuliDirectionSSE41 for 8 pixels.
+template<class Stencil, int CN>
+AUTOFOCUS_TARGET("avx2")
+static inline void StimuliDirectionAVX2(const uchar* prevRow, const uchar* const* currRows, int x, __m256& dirX, __m256& dirY, __m256& magnitude)
+{
+    const __m256 one = _mm256_set1_ps(1.0f), maxDiff = _mm256_set1_ps(255.0f * CN), minLength = _mm256_set1_ps(0.1f);
+
+    __m256i own = StimuliLoadAVX2<CN>(prevRow + x * CN);
+    dirX = _mm256_setzero_ps();
+    dirY = _mm256_setzero_ps();
+    for (int k = 0; k < Stencil::count; k++)
+    {
+        __m256i test = StimuliLoadAVX2<CN>(currRows[Stencil::radius + Stencil::dy[k]] + (x + Stencil::dx[k]) * CN);
+        __m256 similarity = _mm256_sub_ps(one, _mm256_div_ps(_mm256_cvtepi32_ps(StimuliDiffAVX2<CN>(own, test)), maxDiff));
+        if (Stencil::wx[k] != 0.0f)
+            dirX = _mm256_add_ps(dirX, _mm256_mul_ps(_mm256_set1_ps(Stencil::wx[k]), similarity));
+        if (Stencil::wy[k] != 0.0f)
+            dirY = _mm256_add_ps(dirY, _mm256_mul_ps(_mm256_set1_ps(Stencil::wy[k]), similarity));
+    }
+
+    __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dirX, dirX), _mm256_mul_ps(dirY, dirY)));
+    __m256 keep = _mm256_cmp_ps(length, minLength, _CMP_GE_OQ);
+    dirX = _mm256_and_ps(_mm256_div_ps(dirX, length), keep);
+    dirY = _mm256_and_ps(_mm256_div_ps(dirY, length), keep);
+    magnitude = _mm256_and_ps(length, keep);
+}
+
+// StimuliPackedNibblesSSE41 for 8 directions.
+AUTOFOCUS_TARGET("avx2")
+static inline __m256i StimuliPackedNibblesAVX2(__m256 dirX, __m256 dirY)
+{
+    const __m256 zero = _mm256_setzero_ps(), tan225 = _mm256_set1_ps(0.41421356f);
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 ax = _mm256_and_ps(dirX, absMask), ay = _mm256_and_ps(dirY, absMask);
+    __m256 left = _mm256_cmp_ps(dirX, zero, _CMP_LT_OQ), up = _mm256_cmp_ps(dirY, zero, _CMP_LT_OQ);
+
+    __m256 horizontal = _mm256_blendv_ps(_mm256_set1_ps(12.0f), _mm256_set1_ps(8.0f), left);
+    __m256 vertical = _mm256_blendv_ps(_mm256_set1_ps(14.0f), _mm256_set1_ps(10.0f), up);
+    __m256 diagonal = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_set1_ps(13.0f), _mm256_set1_ps(15.0f), left),
+        _mm256_blendv_ps(_mm256_set1_ps(11.0f), _mm256_set1_ps(9.0f), left), up);
+    __m256 nibble = _mm256_blendv_ps(diagonal, vertical, _mm256_cmp_ps(ax, _mm256_mul_ps(tan225, ay), _CMP_LE_OQ));
+    nibble = _mm256_blendv_ps(nibble, horizontal, _mm256_cmp_ps(ay, _mm256_mul_ps(tan225, ax), _CMP_LE_OQ));
+
+    __m256 none = _mm256_and_ps(_mm256_cmp_ps(ax, zero, _CMP_EQ_OQ), _mm256_cmp_ps(ay, zero, _CMP_EQ_OQ));
+    return _mm256_cvttps_epi32(_mm256_andnot_ps(none, nibble));
+}
+
+// 8 pixels per iteration, packed output fills 4 whole bytes per block.
+template<class Stencil, int CN, int Output>
+AUTOFOCUS_TARGET("avx2")
+static int GetStimuliRowAVX2(const uchar* prevRow, const uchar* const* currRows, uchar* outRow, int xBegin, int xEnd, int width)
+{
+    // packed bytes are x0..3 y0..3 x4..7 y4..7, split into the first 16 and the last 8 output bytes
+    const __m128i interleaveLo = _mm_setr_epi8(0, 4, -1, 1, 5, -1, 2, 6, -1, 3, 7, -1, 8, 12, -1, 9);
+    const __m128i interleaveHi = _mm_setr_epi8(13, -1, 10, 14, -1, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i fillLo = _mm_setr_epi8(0, 0, 127, 0, 0, 127, 0, 0, 127, 0, 0, 127, 0, 0, 127, 0);
+    const __m128i fillHi = _mm_setr_epi8(0, 127, 0, 0, 127, 0, 0, 127, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256 one = _mm256_set1_ps(1.0f), outScale = _mm256_set1_ps(255.0f), half = _mm256_set1_ps(0.5f);
+
+    int x = xBegin;
+    // widest load is the bgr high lane (16 bytes from pixel x + radius + 4) or the 8 gray bytes from pixel x + radius
+    int last = min(xEnd - 8, (CN == 1 ? width - 8 : width - 10) - Stencil::radius);
+    for (; x <= last; x += 8)
+    {
+        __m256 dirX, dirY, magnitude;
+        StimuliDirectionAVX2<Stencil, CN>(prevRow, currRows, x, dirX, dirY, magnitude);
+
+        if (Output == OutputFieldMagnitude)
+        {
+            float* o = (float*)outRow + x * 3;
+            StoreFieldMagnitudeSSE41(o, _mm256_castps256_ps128(dirX), _mm256_castps256_ps128(dirY), _mm256_castps256_ps128(magnitude));
+            StoreFieldMagnitudeSSE41(o + 12, _mm256_extractf128_ps(dirX, 1), _mm256_extractf128_ps(dirY, 1), _mm256_extractf128_ps(magnitude, 1));
+            continue;
+        }
+        if (Output == OutputPacked)
+        {
+            __m256i nibbles = StimuliPackedNibblesAVX2(dirX, dirY);
+            __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(nibbles), _mm256_extracti128_si256(nibbles, 1));
+            int pairs = _mm_cvtsi128_si32(StimuliPackNibblesSSE41(_mm_packus_epi16(words, _mm_setzero_si128())));
+            memcpy(outRow + x / 2, &pairs, 4);
+            continue;
+        }
+        if (Output == OutputField)
+        {
+            // unpack works per lane: lo = x0 y0 x1 y1 | x4 y4 x5 y5, hi = x2 y2 x3 y3 | x6 y6 x7 y7
+            __m256 lo = _mm256_unpacklo_ps(dirX, dirY), hi = _mm256_unpackhi_ps(dirX, dirY);
+            float* o = (float*)outRow + x * 2;
+            _mm256_storeu_ps(o, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps(o + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+            continue;
+        }
+
+        __m256i mappedX = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(dirX, one), outScale), half));
+        __m256i mappedY = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(dirY, one), outScale), half));
+        __m256i words = _mm256_packus_epi32(mappedX, mappedY); // x0..3 y0..3 | x4..7 y4..7
+        __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+
+        uchar* o = outRow + x * 3;
+        _mm_storeu_si128((__m128i*)o, _mm_or_si128(_mm_shuffle_epi8(packed, interleaveLo), fillLo));
+        _mm_storel_epi64((__m128i*)(o + 16), _mm_or_si128(_mm_shuffle_epi8(packed, interleaveHi), fillHi));
+    }
+    return x;
+}
+#endif
+
+static int GetStimuliRowNone(const uchar*, const uchar* const*, uchar*, int xBegin, int, int)
+{
+    return xBegin;
+}
+
+template<class Stencil, int CN, int Output>
+static StimuliRowFunc SelectStimuliRowFunc()
+{
+#ifdef AUTOFOCUS_X86
+    if (checkHardwareSupport(CV_CPU_AVX2))
+        return GetStimuliRowAVX2<Stencil, CN, Output>;
+    if (checkHardwareSupport(CV_CPU_SSE4_1))
+        return GetStimuliRowSSE41<Stencil, CN, Output>;
+#endif
+    return GetStimuliRowNone;
+}
+
+// pixels [xBegin, xEnd) of one row, simd first and the scalar row for the rest. the simd rows write packed output a
+// whole byte at a time, so an odd first pixel is done on its own to get them to an even x.
+template<class Stencil, int CN, int Output>
+static inline void GetStimuliRowRange(StimuliRowFunc rowFunc, const uchar* prevRow, const uchar* const* currRows, uchar* outRow, int xBegin, int xEnd, int width)
+{
+    int x = xBegin;
+    if (Output == OutputPacked && (x & 1) && x < xEnd)
+    {
+        GetStimuliRowScalar<Stencil, CN, Output>(prevRow, currRows, outRow, x, x + 1);
+        x++;
+    }
+    x = rowFunc(prevRow, currRows, outRow, x, xEnd, width);
+    GetStimuliRowScalar<Stencil, CN, Output>(prevRow, currRows, outRow, x, xEnd);
+}
+
+template<class Stencil, int CN, int Output>
+static void GetStimuliRows(const Mat& prev, const Mat& curr, Mat& out, int yBegin, int yEnd)
+{
+    static const StimuliRowFunc rowFunc = SelectStimuliRowFunc<Stencil, CN, Output>();
+    const int radius = Stencil::radius;
+
+    for (int y = yBegin; y < yEnd; y++)
+    {
+        const uchar* currRows[2 * radius + 1];
+        for (int dy = -radius; dy <= radius; dy++)
+            currRows[radius + dy] = curr.ptr<uchar>(y + dy);
+        const uchar* prevRow = prev.ptr<uchar>(y);
+        uchar* outRow = out.ptr<uchar>(y);
+
+        GetStimuliRowRange<Stencil, CN, Output>(rowFunc, prevRow, currRows, outRow, radius, prev.cols - radius, prev.cols);
+    }
+}
+
+// processes output rows [yBegin, yEnd) of one instantiation, rows have to stay inside radius..rows-radius-1
+typedef void (*StimuliRowsFunc)(const Mat& prev, const Mat& curr, Mat& out, int yBegin, int yEnd);
+
+#define AUTOFOCUS_STIMULI_OUTPUTS(taps, cn) \
+    { GetStimuliRows<StencilTaps<taps>, cn, OutputEncoded>, GetStimuliRows<StencilTaps<taps>, cn, OutputField>, \
+      GetStimuliRows<StencilTaps<taps>, cn, OutputPacked>, GetStimuliRows<StencilTaps<taps>, cn, OutputFieldMagnitude> }
+#define AUTOFOCUS_STIMULI_ROWS(taps) { AUTOFOCUS_STIMULI_OUTPUTS(taps, 1), AUTOFOCUS_STIMULI_OUTPUTS(taps, 3) }
+
+// runtime dispatch, [stencil][gray / bgr][StimuliOutput]
+static const StimuliRowsFunc stimuliRowsTable[StencilCount][2][OutputCount] =
+{
+    AUTOFOCUS_STIMULI_ROWS(4),
+    AUTOFOCUS_STIMULI_ROWS(8),
+    AUTOFOCUS_STIMULI_ROWS(16),
+    AUTOFOCUS_STIMULI_ROWS(24)
+};
+static const int stencilRadius[StencilCount] = { StencilTaps<4>::radius, StencilTaps<8>::radius, StencilTaps<16>::radius, StencilTaps<24>::radius };
+static const char* const stencilNames[StencilCount] = { "cross4", "ring8", "ring16", "ring24" };
+
+int StimuliStencilRadius(StimuliStencil stencil)
+{
+    CV_Assert(stencil >= 0 && stencil < StencilCount);
+    return stencilRadius[stencil];
+}
+
+const char* StimuliStencilName(StimuliStencil stencil)
+{
+    CV_Assert(stencil >= 0 && stencil < StencilCount);
+    return stencilNames[stencil];
+}
+
+static StimuliOutput OutputOf(const Mat& out)
+{
+    switch (out.type())
+    {
+    case CV_32FC2: return OutputField;
+    case CV_8UC1: return OutputPacked;
+    case CV_32FC3: return OutputFieldMagnitude;
+    default: return OutputEncoded;
+    }
+}
+
+// gray and bgr inputs are separate instantiations, the output format follows out's type.
+static void GetStimuliRows(const Mat& prev, const Mat& curr, Mat& out, int yBegin, int yEnd, StimuliStencil stencil)
+{
+    stimuliRowsTable[stencil][prev.channels() == 1 ? 0 : 1][OutputOf(out)](prev, curr, out, yBegin, yEnd);
+}
+
+static void CheckStimuliArguments(const Mat& prev, const Mat& curr, const Mat& out, StimuliStencil stencil = Stencil8)
+{
+    CV_Assert(stencil >= 0 && stencil < StencilCount);
+    CV_Assert((prev.type() == CV_8UC1 || prev.type() == CV_8UC3) && curr.type() == prev.type());
+    CV_Assert(prev.size() == curr.size());
+    if (out.type() == CV_8UC1)
+        CV_Assert(out.size() == PackedDirectionMapSize(prev.size()));
+    else
+        CV_Assert((out.type() == CV_8UC3 || out.type() == CV_32FC2 || out.type() == CV_32FC3) && prev.size() == out.size());
+}
+
+void GetStimuli(const Mat& prev, const Mat& curr, Mat& out, StimuliStencil stencil) // core algorithm of autofocus concept
+{
+    CheckStimuliArguments(prev, curr, out, stencil);
+
+    int radius = stencilRadius[stencil];
+    if (prev.cols > 2 * radius)
+        GetStimuliRows(prev, curr, out, radius, prev.rows - radius, stencil);
+}
+
+// every output pixel only reads prev at that pixel and a (2 radius + 1) window of curr, so the frame splits into row
+// bands that run independently. a band reads radius extra rows of curr above and below itself (the halo) straight
+// from the shared image and only writes its own rows of out, so no copies are needed and the result does not depend
+// on how the bands are scheduled.
+class StimuliBandBody : public ParallelLoopBody
+{
+public:
+    StimuliBandBody(const Mat& prev, const Mat& curr, Mat& out, int bandRows, StimuliStencil stencil)
+        : prev(prev), curr(curr), out(out), bandRows(bandRows), stencil(stencil), radius(stencilRadius[stencil]) {}
+
+    void operator()(const Range& bands) const override
+    {
+        int yBegin = radius + bands.start * bandRows;
+        int yEnd = min(prev.rows - radius, radius + bands.end * bandRows);
+        GetStimuliRows(prev, curr, out, yBegin, yEnd, stencil);
+    }
+
+private:
+    const Mat& prev;
+    const Mat& curr;
+    Mat& out;
+    int bandRows;
+    StimuliStencil stencil;
+    int radius;
+};
+
+void GetStimuliParallel(const Mat& prev, const Mat& curr, Mat& out, int bandRows, StimuliStencil stencil)
+{
+    CheckStimuliArguments(prev, curr, out, stencil);
+    CV_Assert(bandRows > 0);
+
+    int radius = stencilRadius[stencil];
+    int bandCount = (prev.rows - 2 * radius + bandRows - 1) / bandRows;
+    if (bandCount <= 0 || prev.cols <= 2 * radius)
+        return;
+
+    parallel_for_(Range(0, bandCount), StimuliBandBody(prev, curr, out, bandRows, stencil), bandCount);
+}
+
+// per pixel change mask, l1 over the channels like similarityL1
+template<int CN>
+static void MarkChangedPixels(const Mat& prev, const Mat& curr, int epsilon, Mat& changed)
+{
+    for (int y = 0; y < prev.rows; y++)
+    {
+        const uchar* a = prev.ptr<uchar>(y);
+        const uchar* b = curr.ptr<uchar>(y);
+        uchar* c = changed.ptr<uchar>(y);
+        for (int x = 0; x < prev.cols; x++, a += CN, b += CN)
+        {
+            int diff = 0;
+            for (int k = 0; k < CN; k++)
+                diff += abs(a[k] - b[k]);
+            c[x] = diff > epsilon ? 255 : 0;
+        }
+    }
+}
+
+void BuildStimuliActiveRuns(const Mat& prev, const Mat& curr, int epsilon, StimuliActiveRuns& active)
+{
+    CV_Assert((prev.type() == CV_8UC1 || prev.type() == CV_8UC3) && curr.type() == prev.type() && prev.size() == curr.size());
+
+    active.changed.create(prev.size(), CV_8UC1);
+    if (prev.channels() == 1)
+        MarkChangedPixels<1>(prev, curr, epsilon, active.changed);
+    else
+        MarkChangedPixels<3>(prev, curr, epsilon, active.changed);
+
+    // a pixel needs the kernel if anything in its 3x3 window changed
+    dilate(active.changed, active.window, Mat());
+
+    active.rowStart.assign(prev.rows + 1, 0);
+    active.runs.clear();
+    active.activePixels = 0;
+    for (int y = 1; y < prev.rows - 1; y++)
+    {
+        active.rowStart[y] = (int)active.runs.size();
+        const uchar* window = active.window.ptr<uchar>(y);
+        for (int x = 1; x < prev.cols - 1; x++)
+        {
+            if (!window[x])
+                continue;
+
+            int runBegin = x;
+            while (x < prev.cols - 1 && window[x])
+                x++;
+            active.runs.push_back(Vec2i(runBegin, x));
+            active.activePixels += x - runBegin;
+        }
+    }
+    for (int y = max(prev.rows - 1, 1); y <= prev.rows; y++)
+        active.rowStart[y] = (int)active.runs.size();
+}
+
+// the active runs come from 3x3 windows, so sparse mode only has the original 8 neighbor stencil
+template<int CN, int Output>
+static void GetStimuliRuns(const Mat& prev, const Mat& curr, Mat& out, const StimuliActiveRuns& active)
+{
+    typedef StencilTaps<8> Stencil;
+    static const StimuliRowFunc rowFunc = SelectStimuliRowFunc<Stencil, CN, Output>();
+
+    for (int y = 1; y < prev.rows - 1; y++)
+    {
+        const uchar* currRows[3] = { curr.ptr<uchar>(y - 1), curr.ptr<uchar>(y), curr.ptr<uchar>(y + 1) };
+        const uchar* prevRow = prev.ptr<uchar>(y);
+        uchar* outRow = out.ptr<uchar>(y);
+
+        for (int r = active.rowStart[y]; r < active.rowStart[y + 1]; r++)
+        {
+            const Vec2i& run = active.runs[r];
+            GetStimuliRowRange<Stencil, CN, Output>(rowFunc, prevRow, currRows, outRow, run[0], run[1], prev.cols);
+        }
+    }
+}
+
+void GetStimuliSparse(const Mat& prev, const Mat& curr, Mat& out, const StimuliActiveRuns& active)
+{
+    CheckStimuliArguments(prev, curr, out);
+    CV_Assert((int)active.rowStart.size() == prev.rows + 1);
+
+    typedef void (*StimuliRunsFunc)(const Mat& prev, const Mat& curr, Mat& out, const StimuliActiveRuns& active);
+    static const StimuliRunsFunc runsTable[2][OutputCount] =
+    {
+        { GetStimuliRuns<1, OutputEncoded>, GetStimuliRuns<1, OutputField>, GetStimuliRuns<1, OutputPacked>, GetStimuliRuns<1, OutputFieldMagnitude> },
+        { GetStimuliRuns<3, OutputEncoded>, GetStimuliRuns<3, OutputField>, GetStimuliRuns<3, OutputPacked>, GetStimuliRuns<3, OutputFieldMagnitude> }
+    };
+    runsTable[prev.channels() == 1 ? 0 : 1][OutputOf(out)](prev, curr, out, active);
+}
+
+void EncodeDirectionField(const Mat& field, Mat& out)
+{
+    CV_Assert(field.type() == CV_32FC2 || field.type() == CV_32FC3);
+    int cn = field.channels();
+    if (out.size() != field.size() || out.type() != CV_8UC3)
+    {
+        out.create(field.size(), CV_8UC3);
+        out.setTo(Scalar(0, 0, 0));
+    }
+
+    for (int y = 1; y < field.rows - 1; y++)
+    {
+        const float* in = field.ptr<float>(y);
+        Vec3b* o = out.ptr<Vec3b>(y);
+        for (int x = 1; x < field.cols - 1; x++)
+            o[x] = Vec3b((int)mapFloatSafe(in[x * cn], -1.0f, 1.0f, 0.0f, 255.0f), (int)mapFloatSafe(in[x * cn + 1], -1.0f, 1.0f, 0.0f, 255.0f), 127);
+    }
+}
+
+void ClearDirectionMap(Mat& out)
+{
+    CV_Assert(out.type() == CV_8UC3 || out.type() == CV_32FC2 || out.type() == CV_32FC3 || out.type() == CV_8UC1);
+    if (out.type() == CV_8UC1)
+    {
+        out.setTo(Scalar(0)); // the border nibbles are 0 as well, like a map allocated with PackedDirectionMapSize
+        return;
+    }
+    if (out.rows <= 2 || out.cols <= 2)
+        return;
+
+    Mat interior = out(Rect(1, 1, out.cols - 2, out.rows - 2));
+    if (out.type() == CV_8UC3)
+        interior.setTo(Scalar(127, 127, 127));
+    else
+        interior.setTo(Scalar::all(0));
+}
+
+double UpdateDirectionCodes(const Mat& out, Mat& codes)
+{
+    CV_Assert(out.type() == CV_8UC3 || out.type() == CV_32FC2 || out.type() == CV_32FC3);
+    if (codes.size() != out.size() || codes.type() != CV_8UC1)
+    {
+        codes.create(out.size(), CV_8UC1);
+        codes.setTo(Scalar(0));
+    }
+    if (out.rows <= 2 || out.cols <= 2)
+        return 0.0;
+
+    size_t changed = 0;
+    bool encoded = out.type() == CV_8UC3;
+    for (int y = 1; y < out.rows - 1; y++)
+    {
+        uchar* c = codes.ptr<uchar>(y);
+        for (int x = 1; x < out.cols - 1; x++)
+        {
+            uchar code;
+            if (encoded)
+            {
+                // (127, 127) is no direction, the rest is the direction scaled to [0, 255]
+                const uchar* o = out.ptr<uchar>(y) + x * 3;
+                code = o[0] == 127 && o[1] == 127 ? 0 : DirectionCode(o[0] - 127.5f, o[1] - 127.5f);
+            }
+            else
+            {
+                const float* v = out.ptr<float>(y) + x * out.channels();
+                code = DirectionCode(v[0], v[1]);
+            }
+
+            changed += code != c[x] ? 1 : 0;
+            c[x] = code;
+        }
+    }
+    return (double)changed / ((out.rows - 2) * (out.cols - 2));
+}
+
+Size PackedDirectionMapSize(Size imageSize)
+{
+    return Size((imageSize.width + 1) / 2, imageSize.height);
+}
+
+// both nibbles of every byte value at once: codes[2 * byte] for the even pixel, codes[2 * byte + 1] for the odd one
+struct PackedCodeTable
+{
+    uchar codes[256 * 2];
+
+    PackedCodeTable()
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            codes[b * 2] = PackedDirectionCode((uchar)(b & 0x0F));
+            codes[b * 2 + 1] = PackedDirectionCode((uchar)(b >> 4));
+        }
+    }
+};
+
+void UnpackDirectionMap(const Mat& packed, int width, Mat& out)
+{
+    CV_Assert(packed.type() == CV_8UC1 && packed.cols == (width + 1) / 2);
+    CV_Assert(out.empty() || out.type() == CV_8UC1 || out.type() == CV_8UC3);
+    int type = out.empty() ? CV_8UC1 : out.type();
+    if (out.size() != Size(width, packed.rows))
+    {
+        out.create(packed.rows, width, type);
+        out.setTo(Scalar::all(0));
+    }
+
+    static const PackedCodeTable table;
+    Vec3b encodedSectors[9];
+    encodedSectors[0] = Vec3b(127, 127, 127);
+    for (int k = 0; k < 8; k++)
+        encodedSectors[k + 1] = Vec3b((int)mapFloatSafe(directionsF[k].x, -1.0f, 1.0f, 0.0f, 255.0f), (int)mapFloatSafe(directionsF[k].y, -1.0f, 1.0f, 0.0f, 255.0f), 127);
+
+    for (int y = 0; y < packed.rows; y++)
+    {
+        const uchar* in = packed.ptr<uchar>(y);
+        if (type == CV_8UC1)
+        {
+            // two codes per byte straight from the table, the odd last pixel on its own
+            uchar* o = out.ptr<uchar>(y);
+            int pairs = width / 2;
+            for (int i = 0; i < pairs; i++)
+                memcpy(o + i * 2, table.codes + in[i] * 2, 2);
+            if (width & 1)
+                o[width - 1] = table.codes[in[pairs] * 2];
+        }
+        else
+        {
+            Vec3b* o = out.ptr<Vec3b>(y);
+            for (int x = 0; x < width; x++)
+                o[x] = encodedSectors[table.codes[in[x >> 1] * 2 + (x & 1)]];
+        }
+    }
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+// the autofocus direction kernel (see autofocus.cpp for the idea), shared by every autofocus entry point.
+// all versions take two adjacent blur levels, prev (more blurred) and curr (less blurred), and write the direction map
+// into out. levels can be CV_8UC3 or CV_8UC1, gray input is its own instantiation that reads a third of the bytes and
+// gives exactly the result of the same image converted to bgr. the format of out follows its type:
+// CV_8UC3 - visual encoding, x and y direction in the first two channels mapped from [-1, 1] to [0, 255], 127 in the
+//           third. (127, 127) means no direction.
+// CV_32FC2 - the normalized direction itself, (0, 0) means no direction. this is what propagateIfOppositeMulti and
+//            other consumers want, read it through DirectionFieldView.
+// CV_32FC3 - the CV_32FC2 field plus the length of the direction before it was normalized (0 where it was pruned) as
+//            third channel, the strength ExtractImpulses (AutofocusImpulses.h) thins the field by.
+// CV_8UC1 - packed, sized with PackedDirectionMapSize. only the sector (one of the 8 neighbor directions) and an
+//           active bit per pixel, half a byte instead of 3 or 8. read it with the packed helpers at the end of this file.
+// GetStimuliReference only does CV_8UC3 in and out.
+// the 1 pixel border of out is never written.
+
+// neighborhood the kernels compare prev's pixel against. every stencil is compiled into its own unrolled kernels and
+// picked at runtime. the wider rings catch more motion per level pair, but leave a border of radius pixels unwritten
+// instead of 1. only Stencil8 (the original) matches GetStimuliReference.
+enum StimuliStencil
+{
+    Stencil4, // left, up, right, down
+    Stencil8, // the 3x3 window, the original algorithm
+    Stencil16, // border of the 5x5 window
+    Stencil24, // border of the 7x7 window
+    StencilCount
+};
+
+int StimuliStencilRadius(StimuliStencil stencil);
+const char* StimuliStencilName(StimuliStencil stencil);
+
+// original per pixel version, slow. the fast versions are checked against it.
+void GetStimuliReference(const cv::Mat& prev, const cv::Mat& curr, cv::Mat& out);
+
+// row-major simd version (avx2 / sse4.1 / scalar picked at runtime), bit-for-bit identical to GetStimuliReference.
+void GetStimuli(const cv::Mat& prev, const cv::Mat& curr, cv::Mat& out, StimuliStencil stencil = Stencil8);
+
+// GetStimuli split into row bands on opencv's thread pool, its size is set with cv::setNumThreads.
+// output is identical to GetStimuli.
+void GetStimuliParallel(const cv::Mat& prev, const cv::Mat& curr, cv::Mat& out, int bandRows = 32, StimuliStencil stencil = Stencil8);
+
+// sparse mode. between two close blur levels most flat pixels barely change, so first a cheap mask of the pixels whose
+// 3x3 window changed by more than epsilon (l1 over the channels) is built as run-lengths, then the kernel only runs on
+// those runs. every other pixel of out keeps the value it had from the previous level pair, so this is an
+// approximation of GetStimuli that gets cheaper the emptier the image is. out has to start cleared with
+// ClearDirectionMap, pixels that never change would keep their initial value otherwise.
+struct StimuliActiveRuns
+{
+    std::vector<int> rowStart; // runs of row y are runs[rowStart[y]] .. runs[rowStart[y + 1] - 1]
+    std::vector<cv::Vec2i> runs; // [xBegin, xEnd)
+    size_t activePixels = 0;
+    cv::Mat changed, window; // scratch masks, kept so rebuilding does not allocate
+};
+
+void BuildStimuliActiveRuns(const cv::Mat& prev, const cv::Mat& curr, int epsilon, StimuliActiveRuns& active);
+void GetStimuliSparse(const cv::Mat& prev, const cv::Mat& curr, cv::Mat& out, const StimuliActiveRuns& active);
+
+// sets the interior of out (CV_8UC3, CV_32FC2 or CV_32FC3) to "no direction", the value GetStimuli writes for a flat
+// window. the border stays as it is, like the kernels leave it.
+void ClearDirectionMap(cv::Mat& out);
+
+// convergence measure for early termination of the level loop. quantizes the direction of every interior pixel of out
+// (CV_8UC3, CV_32FC2 or CV_32FC3) to one of the 8 neighbor directions, or none, writes the codes into codes (CV_8UC1,
+// allocated and zeroed if it does not fit) and returns the fraction of pixels whose code changed from what codes held
+// before.
+// start every image with a zeroed codes mat, the first pass then reports the fraction of active pixels.
+double UpdateDirectionCodes(const cv::Mat& out, cv::Mat& codes);
+
+// visualization post-pass for a CV_32FC2 or CV_32FC3 field, produces exactly what GetStimuli writes into a CV_8UC3 out.
+// like the kernels it leaves the 1 pixel border of out alone (zeroed if out had to be allocated).
+void EncodeDirectionField(const cv::Mat& field, cv::Mat& out);
+
+// zero-copy, read-only view of a CV_32FC2 direction field for consumers that walk the directions.
+// it borrows the field's memory, so the field has to outlive the view and must not be reallocated meanwhile.
+struct DirectionFieldView
+{
+    const uchar* data = nullptr;
+    size_t step = 0; // bytes between rows
+    int rows = 0;
+    int cols = 0;
+
+    DirectionFieldView() {}
+    explicit DirectionFieldView(const cv::Mat& field) : data(field.data), step(field.step), rows(field.rows), cols(field.cols)
+    {
+        CV_Assert(field.type() == CV_32FC2);
+    }
+
+    const cv::Vec2f* row(int y) const { return reinterpret_cast<const cv::Vec2f*>(data + y * step); }
+    const cv::Vec2f& at(int y, int x) const { return row(y)[x]; }
+    bool isActive(int y, int x) const { return at(y, x)[0] != 0.0f || at(y, x)[1] != 0.0f; }
+};
+
+// packed direction map: pixel x of a row is the low (even x) or high (odd x) nibble of byte x / 2. a nibble is 0 for no
+// direction, 8 | sector otherwise, sector 0..7 being the directions[] neighbor (left first, clockwise) the direction
+// is closest to. the sector is the code UpdateDirectionCodes gives the same direction in a CV_32FC2 field, minus 1.
+cv::Size PackedDirectionMapSize(cv::Size imageSize);
+
+inline uchar PackedDirectionNibble(const uchar* packedRow, int x)
+{
+    return (packedRow[x >> 1] >> ((x & 1) * 4)) & 0x0F;
+}
+
+// nibble to the UpdateDirectionCodes code, 1..8 or 0 for no direction
+inline uchar PackedDirectionCode(uchar nibble)
+{
+    return nibble & 8 ? (nibble & 7) + 1 : 0;
+}
+
+// width is the width of the image the map was made from. out is CV_8UC1 (allocated as such if empty) for the
+// UpdateDirectionCodes codes, or CV_8UC3 for the GetStimuli visual encoding of the sector direction.
+void UnpackDirectionMap(const cv::Mat& packed, int width, cv::Mat& out);
+
+// calls visit(x, y, sector) for every active pixel in row order. 8 bytes (16 pixels) without a direction are skipped
+// with a single compare, so a mostly empty map is walked at about the speed of reading it.
+template<class Visitor>
+void ForEachActiveDirection(const cv::Mat& packed, int width, Visitor visit)
+{
+    CV_Assert(packed.type() == CV_8UC1 && packed.cols == (width + 1) / 2);
+    for (int y = 0; y < packed.rows; y++)
+    {
+        const uchar* row = packed.ptr<uchar>(y);
+        int i = 0;
+        for (; i + 8 <= packed.cols; i += 8)
+        {
+            uint64_t block;
+            memcpy(&block, row + i, 8);
+            if ((block & 0x8888888888888888ull) == 0)
+                continue;
+            for (int b = i; b < i + 8; b++)
+            {
+                if (row[b] & 0x08)
+                    visit(b * 2, y, row[b] & 7);
+                if (row[b] & 0x80 && b * 2 + 1 < width)
+                    visit(b * 2 + 1, y, (row[b] >> 4) & 7);
+            }
+        }
+        for (; i < packed.cols; i++)
+        {
+            if (row[i] & 0x08)
+                visit(i * 2, y, row[i] & 7);
+            if (row[i] & 0x80 && i * 2 + 1 < width)
+                visit(i * 2 + 1, y, (row[i] >> 4) & 7);
+        }
+    }
+}
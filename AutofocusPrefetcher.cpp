@@ -0,0 +1,75 @@
+#include "AutofocusPrefetcher.h"
+#include "Autofocus.h"
+
+ImagePrefetcher::ImagePrefetcher(const std::vector<std::string>& paths, int imreadFlags, int threads, int depth)
+    : paths(paths), imreadFlags(imreadFlags), ring(depth)
+{
+    CV_Assert(threads >= 1 && depth >= 1);
+
+    for (int i = 0; i < threads; i++)
+        decoders.emplace_back(&ImagePrefetcher::decode, this);
+}
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread& decoder : decoders)
+        decoder.join();
+}
+
+const ImagePrefetcher::Image* ImagePrefetcher::next()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    if (returned)
+    {
+        returned->state = Free;
+        returned = nullptr;
+        changed.notify_all();
+    }
+    if (nextToReturn >= paths.size())
+        return nullptr;
+
+    // image n is always decoded into slot n % depth, so the consumer only waits on that one
+    Slot& slot = ring[nextToReturn % ring.size()];
+    changed.wait(guard, [&]() { return slot.state == Ready && slot.image.index == nextToReturn; });
+    nextToReturn++;
+    returned = &slot;
+    return &slot.image;
+}
+
+void ImagePrefetcher::decode()
+{
+    for (;;)
+    {
+        Slot* slot;
+        size_t index;
+        {
+            // the next image waits for its slot, decoders never run ahead of the ring
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&]() { return stopping || nextToLoad >= paths.size() || ring[nextToLoad % ring.size()].state == Free; });
+            if (stopping || nextToLoad >= paths.size())
+                return;
+
+            index = nextToLoad++;
+            slot = &ring[index % ring.size()];
+            slot->state = Loading;
+        }
+
+        cv::int64 start = cv::getTickCount();
+        slot->image.index = index;
+        slot->image.path = paths[index];
+        if (!ReadFileBytes(paths[index], slot->bytes) || cv::imdecode(slot->bytes, imreadFlags, &slot->image.image).empty())
+            slot->image.image.release();
+        slot->image.loadMs = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            slot->state = Ready;
+        }
+        changed.notify_all();
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// reads and decodes a list of image files ahead of the consumer on background threads, so the autofocus pass on image
+// N overlaps the disk and png / jpeg decoding of the next ones. images come out in list order.
+// like AutofocusStream the images live in a fixed ring of depth slots: a decoder only starts on image N + depth once
+// the consumer handed back image N, so at most depth images are in memory and their buffers (file bytes and decoded
+// mat) are reused once the ring went around.
+class ImagePrefetcher
+{
+public:
+    struct Image
+    {
+        size_t index = 0;
+        std::string path;
+        cv::Mat image; // empty if the file could not be read or decoded
+        double loadMs = 0.0; // read + decode, on the decoder thread
+    };
+
+    ImagePrefetcher(const std::vector<std::string>& paths, int imreadFlags = cv::IMREAD_COLOR, int threads = 2, int depth = 4);
+    ~ImagePrefetcher();
+
+    // blocks until the next image in list order is decoded, nullptr after the last one. the image stays valid until
+    // the next call, which hands its slot back to the decoders.
+    const Image* next();
+
+private:
+    enum SlotState { Free, Loading, Ready };
+
+    struct Slot
+    {
+        Image image;
+        std::vector<uchar> bytes;
+        SlotState state = Free;
+    };
+
+    std::vector<std::string> paths;
+    int imreadFlags;
+    std::vector<Slot> ring;
+    std::vector<std::thread> decoders;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t nextToLoad = 0;
+    size_t nextToReturn = 0;
+    Slot* returned = nullptr; // slot of the image the consumer holds
+    bool stopping = false;
+
+    void decode();
+};
@@ -0,0 +1,152 @@
+#include "AutofocusPyramid.h"
+#include <algorithm>
+
+AutofocusPyramid::AutofocusPyramid(const std::vector<float>& levelSigmas, BlurMode mode, bool chainLevels) : mode(mode), sigmas(levelSigmas), levels(levelSigmas.size())
+{
+    CV_Assert(!sigmas.empty() && sigmas[0] >= 0.0f);
+
+    // kernels only depend on the sigmas, so they are made once here instead of every frame
+    for (size_t i = 0; i < sigmas.size(); i++)
+    {
+        CV_Assert(i == 0 || sigmas[i] >= sigmas[i - 1]);
+
+        float delta = 0.0f;
+        if (i > 0)
+            delta = std::sqrt(sigmas[i] * sigmas[i] - sigmas[i - 1] * sigmas[i - 1]);
+
+        bool fromPrevious = chainLevels && mode == Gaussian && i > 0 && sigmas[i - 1] > 0.0f && delta >= minIncrementalSigma;
+        incremental.push_back(fromPrevious);
+        kernels.push_back(makeKernel(fromPrevious ? delta : sigmas[i]));
+
+        // boxes are cheap at any width, so box levels always come straight from the frame. chaining them would
+        // need tiny boxes for the small sigma steps, which are a bad gaussian approximation.
+        boxWidths.push_back(boxWidthsForSigma(sigmas[i], boxPasses));
+    }
+
+    chained = std::find(incremental.begin(), incremental.end(), true) != incremental.end();
+}
+
+std::vector<float> AutofocusPyramid::linearSigmas(int levelCount, float step)
+{
+    std::vector<float> result;
+    for (int i = 0; i < levelCount; i++)
+        result.push_back(i * step);
+    return result;
+}
+
+cv::Mat AutofocusPyramid::makeKernel(float sigma)
+{
+    if (sigma <= 0.0f)
+        return cv::Mat();
+
+    // same 4 sigma radius opencv picks for float images
+    int radius = std::max(1, cvRound(sigma * 4.0f));
+    return cv::getGaussianKernel(radius * 2 + 1, sigma, CV_32F);
+}
+
+// widths of n stacked box filters whose combined variance is closest to sigma^2 (w^2 - 1) / 12 per box, using the
+// odd widths wl and wl + 2 around the ideal width. from kovesi, "fast almost-gaussian filtering".
+std::vector<int> AutofocusPyramid::boxWidthsForSigma(float sigma, int passes)
+{
+    if (sigma <= 0.0f)
+        return std::vector<int>();
+
+    float idealWidth = std::sqrt(12.0f * sigma * sigma / passes + 1.0f);
+    int lower = cvFloor(idealWidth);
+    if (lower % 2 == 0)
+        lower--;
+    int upper = lower + 2;
+
+    float idealLowerCount = (12.0f * sigma * sigma - passes * lower * lower - 4.0f * passes * lower - 3.0f * passes) / (-4.0f * lower - 4.0f);
+    int lowerCount = std::min(passes, std::max(0, cvRound(idealLowerCount)));
+
+    std::vector<int> widths;
+    for (int i = 0; i < passes; i++)
+        widths.push_back(i < lowerCount ? lower : upper);
+    return widths;
+}
+
+int AutofocusPyramid::reach(int level) const
+{
+    if (mode == BoxApproximation)
+    {
+        int radius = 0;
+        for (int width : boxWidths[level])
+            radius += width / 2;
+        return radius;
+    }
+
+    int radius = kernels[level].empty() ? 0 : kernels[level].rows / 2;
+    return incremental[level] ? radius + reach(level - 1) : radius;
+}
+
+int AutofocusPyramid::haloRadius() const
+{
+    int radius = 0;
+    for (int i = 0; i < levelCount(); i++)
+        radius = std::max(radius, reach(i));
+    return radius;
+}
+
+void AutofocusPyramid::build(const cv::Mat& frame, const std::function<void(int)>& levelReady)
+{
+    start(frame);
+
+    // chained levels can only be built from the least blurred one up. when nothing is chained the levels are
+    // independent, so they are built in the order the autofocus loop consumes them (most blurred first) and a consumer
+    // waiting on levelReady can start on the first pair while the rest are still blurring.
+    for (int n = 0; n < levelCount(); n++)
+    {
+        int i = chained ? n : levelCount() - 1 - n;
+        buildLevel(i);
+
+        if (levelReady)
+            levelReady(i);
+    }
+}
+
+void AutofocusPyramid::start(const cv::Mat& frame)
+{
+    CV_Assert(!frame.empty() && frame.depth() == CV_8U);
+
+    frame.convertTo(frameF, CV_32F);
+    frameType = frame.type();
+    current = 0;
+    lastBuilt = -1;
+}
+
+void AutofocusPyramid::buildLevel(int i)
+{
+    CV_Assert(frameType >= 0 && i >= 0 && i < levelCount());
+    CV_Assert(!incremental[i] || lastBuilt == i - 1);
+
+    // a chained pyramid ping-pongs between the two chain buffers, an unchained one only needs the first
+    int next = chained && lastBuilt >= 0 ? current ^ 1 : 0;
+    cv::Mat& target = chain[next];
+
+    if (kernels[i].empty())
+        frameF.copyTo(target);
+    else if (mode == BoxApproximation)
+    {
+        // running sum box filter, cost per pixel does not depend on the width. ping-pongs with boxScratch so the
+        // last pass lands in target.
+        const cv::Mat* source = &frameF;
+        cv::Mat* destination = boxWidths[i].size() % 2 == 1 ? &target : &boxScratch;
+        for (int width : boxWidths[i])
+        {
+            cv::blur(*source, *destination, cv::Size(width, width), cv::Point(-1, -1), cv::BORDER_REFLECT_101);
+            source = destination;
+            destination = destination == &target ? &boxScratch : &target;
+        }
+    }
+    else
+    {
+        // separable gaussian, sepFilter2D runs the row and column passes with simd on its own
+        const cv::Mat& source = incremental[i] ? chain[current] : frameF;
+        cv::sepFilter2D(source, target, CV_32F, kernels[i], kernels[i], cv::Point(-1, -1), 0.0, cv::BORDER_REFLECT_101);
+    }
+
+    current = next;
+    lastBuilt = i;
+    target.convertTo(levels[i], frameType); // rounds and saturates like imwrite / imread would
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <functional>
+
+// in-process replacement for the precomputed autofocustest1/0..8.png blur levels, so a live camera frame can be fed
+// to the autofocus loop directly.
+// level 0 is the least blurred one and the autofocus loop walks from the last (most blurred) level down to 0.
+// gaussian blurs compose (sigma_c^2 = sigma_a^2 + sigma_b^2), so each level is built from the previous, slightly less
+// blurred one with a small kernel instead of blurring the full frame again with an ever growing kernel.
+class AutofocusPyramid
+{
+public:
+    enum BlurMode
+    {
+        Gaussian, // exact separable gaussian, cost grows with sigma
+        BoxApproximation // 3 stacked box blurs per level, constant cost per pixel whatever the sigma
+    };
+
+    // sigmas[i] is the blur of level i, must be ascending. a sigma of 0 means the raw frame.
+    // chainLevels false blurs every gaussian level straight from the frame with its full sigma. that costs a wider
+    // kernel per level, but no level depends on another one, so buildLevel can skip levels.
+    AutofocusPyramid(const std::vector<float>& sigmas, BlurMode mode = Gaussian, bool chainLevels = true);
+
+    // sigma = i * step for levels 0..levelCount-1, level 0 is the raw frame
+    static std::vector<float> linearSigmas(int levelCount, float step);
+
+    // levelReady (optional) is called with the level index as soon as that level is final. levels come most blurred
+    // first when no level is chained (BoxApproximation), least blurred first otherwise.
+    void build(const cv::Mat& frame, const std::function<void(int)>& levelReady = nullptr);
+
+    // lazy version of build for consumers that may not need every level (early termination): start with the frame,
+    // then build only the levels that are actually used. unchained levels can come in any order, a chained level needs
+    // the level below it built right before.
+    void start(const cv::Mat& frame);
+    void buildLevel(int level);
+    bool isChained() const { return chained; }
+
+    // how far (in pixels) the frame influences a level, through the whole chain for chained levels. a crop of the
+    // frame that is haloRadius() larger on every side gives the same levels as the full frame inside the original
+    // rect (exactly for gaussian, up to float rounding for the running sum box filter).
+    int reach(int level) const;
+    int haloRadius() const;
+
+    BlurMode getMode() const { return mode; }
+    int levelCount() const { return static_cast<int>(sigmas.size()); }
+    float getSigma(int level) const { return sigmas[level]; }
+    const cv::Mat& getLevel(int level) const { return levels[level]; }
+
+private:
+    // below this the sampled delta kernel is too narrow to stay gaussian, blur from the frame instead
+    const float minIncrementalSigma = 0.8f;
+
+    // box widths for a box^3 ~ gaussian, see boxWidthsForSigma
+    static const int boxPasses = 3;
+
+    BlurMode mode;
+    std::vector<float> sigmas;
+    std::vector<std::vector<int>> boxWidths; // per level, only used in BoxApproximation mode
+    std::vector<cv::Mat> kernels; // 1d kernel per level, used for both passes
+    std::vector<bool> incremental; // true if level i is built from level i - 1
+    bool chained; // any level incremental
+    std::vector<cv::Mat> levels; // same type as the input frame
+
+    // float working buffers, the chain of levels stays in float so rounding does not accumulate across levels
+    cv::Mat frameF;
+    cv::Mat chain[2];
+    cv::Mat boxScratch;
+    int frameType = -1;
+    int current = 0; // chain[current] holds the float version of the last built level
+    int lastBuilt = -1;
+
+    static cv::Mat makeKernel(float sigma);
+    static std::vector<int> boxWidthsForSigma(float sigma, int passes);
+};
@@ -0,0 +1,129 @@
+#include "AutofocusStream.h"
+#include "AutofocusKernels.h"
+#include <thread>
+
+AutofocusStream::AutofocusStream(const std::vector<float>& sigmas, AutofocusPyramid::BlurMode mode, int ringSize, bool dropWhenBusy)
+    : dropWhenBusy(dropWhenBusy)
+{
+    CV_Assert(ringSize >= 2 && sigmas.size() >= 2 && sigmas.size() <= 32);
+
+    for (int i = 0; i < ringSize; i++)
+        ring.emplace_back(new Slot(sigmas, mode));
+}
+
+AutofocusStream::Stats AutofocusStream::run(const FrameSource& readFrame, const ResultSink& onResult)
+{
+    Stats stats;
+    producerDone = false;
+    for (auto& slot : ring)
+        slot->queued = false;
+
+    cv::int64 start = cv::getTickCount();
+    std::thread producer(&AutofocusStream::produce, this, std::cref(readFrame), std::ref(stats));
+
+    // slots are filled and consumed in ring order, so the consumer only ever waits on the next one
+    for (size_t tail = 0; consume(*ring[tail], onResult); tail = (tail + 1) % ring.size())
+        stats.framesProcessed++;
+
+    producer.join();
+
+    stats.seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+    stats.fps = stats.seconds > 0.0 ? stats.framesProcessed / stats.seconds : 0.0;
+    return stats;
+}
+
+void AutofocusStream::produce(const FrameSource& readFrame, Stats& stats)
+{
+    size_t head = 0;
+    while (true)
+    {
+        Slot& slot = *ring[head];
+
+        bool slotFree;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!dropWhenBusy)
+                changed.wait(guard, [&] { return !slot.queued; });
+            slotFree = !slot.queued;
+        }
+
+        // consumer is behind, read and throw this frame away rather than letting the queue (and latency) grow
+        if (!slotFree)
+        {
+            if (!readFrame(droppedFrame))
+                break;
+            stats.framesRead++;
+            stats.framesDropped++;
+            std::this_thread::yield();
+            continue;
+        }
+
+        if (!readFrame(slot.frame))
+            break;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            slot.frameIndex = stats.framesRead++;
+            slot.readyLevels = 0;
+            slot.queued = true;
+        }
+        changed.notify_all();
+
+        // levels are published one by one, the consumer may already be working on this slot
+        slot.pyramid.build(slot.frame, [&](int level)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    slot.readyLevels |= 1u << level;
+                }
+                changed.notify_all();
+            });
+
+        head = (head + 1) % ring.size();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        producerDone = true;
+    }
+    changed.notify_all();
+}
+
+void AutofocusStream::waitForLevel(Slot& slot, int level)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&] { return (slot.readyLevels & (1u << level)) != 0; });
+}
+
+// runs the usual level loop (most blurred down to level 0) on one slot. returns false once the stream is over.
+bool AutofocusStream::consume(Slot& slot, const ResultSink& onResult)
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return slot.queued || producerDone; });
+        if (!slot.queued)
+            return false;
+    }
+
+    int top = slot.pyramid.levelCount() - 1;
+    waitForLevel(slot, top);
+
+    const cv::Mat& first = slot.pyramid.getLevel(top);
+    slot.out.create(first.size(), CV_8UC3);
+    slot.out.setTo(cv::Scalar(0, 0, 0));
+
+    for (int level = top - 1; level >= 0; level--)
+    {
+        waitForLevel(slot, level);
+        GetStimuliParallel(slot.pyramid.getLevel(level + 1), slot.pyramid.getLevel(level), slot.out);
+    }
+
+    onResult(slot.frameIndex, slot.out);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        slot.queued = false;
+    }
+    changed.notify_all();
+    return true;
+}
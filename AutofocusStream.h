@@ -0,0 +1,64 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "AutofocusPyramid.h"
+
+// streaming version of the autofocus loop for camera / video input.
+// a producer thread reads frames and builds their blur levels while the calling thread runs GetStimuli on the levels
+// that are already done, so frame N+1's pyramid overlaps frame N's stimulus passes (and, with an unchained pyramid
+// like BoxApproximation, blurring level k-1 overlaps the pass on level k of the same frame).
+// frames, levels and direction maps live in a fixed ring of slots that is reused, so nothing is allocated per frame
+// once the first ringSize frames went through. if every slot is busy the producer either drops the incoming frame
+// (live cameras, latency stays bounded by the ring size) or waits for a slot (files, every frame gets processed).
+// the level loop runs over every level of the pyramid, from the last one down to level 0.
+class AutofocusStream
+{
+public:
+    struct Stats
+    {
+        long long framesRead = 0;
+        long long framesProcessed = 0;
+        long long framesDropped = 0;
+        double seconds = 0.0;
+        double fps = 0.0; // sustained processed frames per second
+    };
+
+    // readFrame fills the given mat (reusing its buffer) and returns false at the end of the stream.
+    // onResult is called on the thread that called run, the direction map is only valid during the call.
+    typedef std::function<bool(cv::Mat&)> FrameSource;
+    typedef std::function<void(long long frameIndex, const cv::Mat& directionMap)> ResultSink;
+
+    AutofocusStream(const std::vector<float>& sigmas, AutofocusPyramid::BlurMode mode = AutofocusPyramid::Gaussian, int ringSize = 3, bool dropWhenBusy = true);
+
+    Stats run(const FrameSource& readFrame, const ResultSink& onResult);
+
+private:
+    struct Slot
+    {
+        AutofocusPyramid pyramid;
+        cv::Mat frame;
+        cv::Mat out;
+        long long frameIndex = -1;
+        bool queued = false; // owned by the consumer from the moment the producer starts building it
+        unsigned int readyLevels = 0; // bit per finished level
+
+        Slot(const std::vector<float>& sigmas, AutofocusPyramid::BlurMode mode) : pyramid(sigmas, mode) {}
+    };
+
+    std::vector<std::unique_ptr<Slot>> ring;
+    bool dropWhenBusy;
+    cv::Mat droppedFrame; // scratch buffer frames are read into when they get dropped
+
+    std::mutex lock;
+    std::condition_variable changed;
+    bool producerDone = false;
+
+    void produce(const FrameSource& readFrame, Stats& stats);
+    bool consume(Slot& slot, const ResultSink& onResult);
+    void waitForLevel(Slot& slot, int level);
+};
@@ -0,0 +1,71 @@
+#include "AutofocusTileReuse.h"
+
+AutofocusTileReuse::AutofocusTileReuse(const Autofocus::Settings& settings, int tileSize, double changeThreshold, double maxRegionCost)
+    : autofocus(settings), tileSize(tileSize), changeThreshold(changeThreshold), maxRegionCost(maxRegionCost)
+{
+    CV_Assert(tileSize > 0 && changeThreshold >= 0.0);
+
+    // early termination would make a tile's result depend on what else is in its crop
+    CV_Assert(settings.convergenceThreshold == 0.0);
+
+    int halo = AutofocusPyramid(settings.sigmas, settings.blurMode).haloRadius() + 1;
+    haloTiles = (halo + tileSize - 1) / tileSize;
+}
+
+AutofocusTileReuse::FrameStats AutofocusTileReuse::process(const cv::Mat& frame, cv::Mat& field)
+{
+    cv::Size tileGrid((frame.cols + tileSize - 1) / tileSize, (frame.rows + tileSize - 1) / tileSize);
+    FrameStats stats;
+    stats.tiles = tileGrid.area();
+    totalTiles += stats.tiles;
+
+    bool restart = reference.size() != frame.size() || reference.type() != frame.type() || field.size() != frame.size() || field.type() != autofocus.getSettings().outputType;
+    if (restart)
+    {
+        frame.copyTo(reference);
+        autofocus.process(frame, field);
+        stats.changedTiles = stats.recomputedTiles = stats.tiles;
+        return stats;
+    }
+
+    // sad per tile against the reference. the reference of every tile that gets recomputed below moves to this frame,
+    // halo tiles included, they are computed from its pixels as well
+    changed.create(tileGrid, CV_8UC1);
+    for (int ty = 0; ty < tileGrid.height; ty++)
+    {
+        for (int tx = 0; tx < tileGrid.width; tx++)
+        {
+            cv::Rect tile = cv::Rect(tx * tileSize, ty * tileSize, tileSize, tileSize) & cv::Rect(0, 0, frame.cols, frame.rows);
+            bool tileChanged = cv::norm(frame(tile), reference(tile), cv::NORM_L1) > changeThreshold;
+            changed.at<uchar>(ty, tx) = tileChanged ? 255 : 0;
+            if (tileChanged)
+                stats.changedTiles++;
+        }
+    }
+
+    // a changed pixel moves the result up to the halo away, so the tiles around a changed one are recomputed as well
+    cv::dilate(changed, dirty, cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * haloTiles + 1, 2 * haloTiles + 1)));
+    stats.recomputedTiles = cv::countNonZero(dirty);
+
+    if (stats.recomputedTiles == 0)
+        regions.clear();
+    else
+        regions = Autofocus::rectsFromTiles(dirty, tileSize, frame.size());
+
+    if (!regions.empty() && autofocus.regionCost(regions, frame.size()) > maxRegionCost)
+    {
+        autofocus.process(frame, field);
+        frame.copyTo(reference);
+        stats.recomputedTiles = stats.tiles;
+    }
+    else if (!regions.empty())
+    {
+        autofocus.processRegions(frame, regions, field);
+        for (const cv::Rect& region : regions)
+            frame(region).copyTo(reference(region));
+    }
+
+    stats.reuseRatio = (double)(stats.tiles - stats.recomputedTiles) / stats.tiles;
+    totalReusedTiles += stats.tiles - stats.recomputedTiles;
+    return stats;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "Autofocus.h"
+
+// video mode for mostly static cameras. frames are split into tiles, a tile whose pixels changed since the last time it
+// was computed (sum of absolute differences above changeThreshold) is dirty, and only the dirty tiles plus the tiles
+// their halo reaches are recomputed, through Autofocus::processRegions. every other tile keeps last frame's result.
+// with changeThreshold 0 the field is exactly what a full recompute would give, above 0 small changes (sensor noise)
+// are ignored until they add up: the reference a tile is compared to only moves when the tile is recomputed.
+// the dirty tiles are merged into rectangles (Autofocus::rectsFromTiles), each of them is cropped with the full halo.
+// once those crops cost more than maxRegionCost full frames (Autofocus::regionCost) the whole frame is recomputed
+// instead, one big crop beats many overlapping halos.
+class AutofocusTileReuse
+{
+public:
+    struct FrameStats
+    {
+        int tiles = 0;
+        int changedTiles = 0; // tiles whose own pixels changed
+        int recomputedTiles = 0; // changed tiles plus the ones inside their halo
+        double reuseRatio = 0.0; // tiles carried over / tiles
+    };
+
+    AutofocusTileReuse(const Autofocus::Settings& settings = Autofocus::Settings(), int tileSize = 64, double changeThreshold = 0.0, double maxRegionCost = 1.0);
+
+    // field keeps the running result, pass the same mat every frame. a new frame size starts over with a full frame.
+    FrameStats process(const cv::Mat& frame, cv::Mat& field);
+
+    // totals over every frame since construction
+    long long getTotalTiles() const { return totalTiles; }
+    long long getTotalReusedTiles() const { return totalReusedTiles; }
+
+private:
+    Autofocus autofocus;
+    int tileSize;
+    double changeThreshold;
+    double maxRegionCost;
+    int haloTiles; // halo of a changed pixel in tiles, the blur halo plus the 3x3 stencil rounded up
+
+    cv::Mat reference; // per tile, the pixels the tile's current result was computed from
+    cv::Mat changed, dirty; // CV_8UC1, one pixel per tile
+    std::vector<cv::Rect> regions;
+
+    long long totalTiles = 0;
+    long long totalReusedTiles = 0;
+};
@@ -0,0 +1,199 @@
+#include "AutofocusTiled.h"
+#include <fstream>
+#include <atomic>
+#include <cstdio>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedRawImage::MappedRawImage(const std::string& path, cv::Size size, int type, bool writable) : imageSize(size), imageType(type)
+{
+    // Size::area is an int, gigapixel scans are past it
+    bytes = (size_t)size.width * size.height * CV_ELEM_SIZE(type);
+    CV_Assert(bytes > 0);
+
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, nullptr, writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    CV_Assert(file != INVALID_HANDLE_VALUE);
+    LARGE_INTEGER length, fileLength;
+    length.QuadPart = (LONGLONG)bytes;
+    if (writable)
+        CV_Assert(SetFilePointerEx(file, length, nullptr, FILE_BEGIN) && SetEndOfFile(file)); // a file left by an earlier run may be bigger
+    CV_Assert(GetFileSizeEx(file, &fileLength) && fileLength.QuadPart == length.QuadPart);
+    mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, length.HighPart, length.LowPart, nullptr);
+    CV_Assert(mapping != nullptr);
+    mapped = (uchar*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, bytes);
+    CV_Assert(mapped != nullptr);
+#else
+    file = open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    CV_Assert(file >= 0);
+    if (writable)
+        CV_Assert(ftruncate(file, (off_t)bytes) == 0);
+    struct stat status;
+    CV_Assert(fstat(file, &status) == 0 && (unsigned long long)status.st_size == bytes); // a raw file of any other size is not this image
+    void* address = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, file, 0);
+    CV_Assert(address != MAP_FAILED);
+    mapped = (uchar*)address;
+#endif
+}
+
+MappedRawImage::~MappedRawImage()
+{
+#ifdef _WIN32
+    UnmapViewOfFile(mapped);
+    CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    munmap(mapped, bytes);
+    close(file);
+#endif
+}
+
+void MappedRawImage::read(const cv::Rect& region, cv::Mat& pixels)
+{
+    view()(region).copyTo(pixels);
+}
+
+void MappedRawImage::write(const cv::Rect& region, const cv::Mat& field)
+{
+    CV_Assert(field.type() == imageType && field.size() == region.size());
+    field.copyTo(view()(region));
+}
+
+TileFileSource::TileFileSource(const std::string& pattern, cv::Size imageSize, int tileSize, int type, int cachedTiles)
+    : pattern(pattern), imageSize(imageSize), tileSize(tileSize), imageType(type), cachedTiles(std::max(1, cachedTiles))
+{
+    CV_Assert(tileSize > 0 && CV_MAT_DEPTH(type) == CV_8U);
+}
+
+static std::string TilePath(const std::string& pattern, cv::Point index)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), pattern.c_str(), index.y, index.x);
+    return path;
+}
+
+cv::Mat TileFileSource::loadTile(cv::Point index)
+{
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        for (auto it = cache.begin(); it != cache.end(); ++it)
+        {
+            if (it->index == index)
+            {
+                cache.splice(cache.begin(), cache, it);
+                return cache.front().pixels;
+            }
+        }
+    }
+
+    // decoded outside the lock, two threads may decode the same tile once in a while, that is fine
+    cv::Mat pixels = cv::imread(TilePath(pattern, index), CV_MAT_CN(imageType) == 1 ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+    cv::Rect expected = cv::Rect(index.x * tileSize, index.y * tileSize, tileSize, tileSize) & cv::Rect(cv::Point(0, 0), imageSize);
+    CV_Assert(pixels.type() == imageType && pixels.size() == expected.size());
+
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cache.push_front({ index, pixels });
+    if (cache.size() > cachedTiles)
+        cache.pop_back();
+    return pixels;
+}
+
+void TileFileSource::read(const cv::Rect& region, cv::Mat& pixels)
+{
+    pixels.create(region.size(), imageType);
+    for (int ty = region.y / tileSize; ty <= (region.y + region.height - 1) / tileSize; ty++)
+    {
+        for (int tx = region.x / tileSize; tx <= (region.x + region.width - 1) / tileSize; tx++)
+        {
+            cv::Mat tile = loadTile(cv::Point(tx, ty));
+            cv::Rect tileRect(tx * tileSize, ty * tileSize, tile.cols, tile.rows);
+            cv::Rect overlap = tileRect & region;
+            tile(overlap - tileRect.tl()).copyTo(pixels(overlap - region.tl()));
+        }
+    }
+}
+
+void TileFileSink::write(const cv::Rect& region, const cv::Mat& field)
+{
+    std::string path = TilePath(pattern, cv::Point(region.x / tileSize, region.y / tileSize));
+    if (field.type() == CV_8UC3)
+    {
+        CV_Assert(cv::imwrite(path, field));
+        return;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    for (int y = 0; y < field.rows; y++)
+        file.write(reinterpret_cast<const char*>(field.ptr(y)), field.cols * field.elemSize());
+    CV_Assert(file.good());
+}
+
+AutofocusTiled::AutofocusTiled(const Autofocus::Settings& settings, int tileSize) : autofocus(settings), tileSize(tileSize)
+{
+    CV_Assert(tileSize > 0 && settings.convergenceThreshold == 0.0);
+    halo = AutofocusPyramid(settings.sigmas, settings.blurMode).haloRadius() + 1;
+}
+
+class AutofocusTiled::TileBody : public cv::ParallelLoopBody
+{
+public:
+    TileBody(Autofocus& autofocus, AutofocusTileSource& source, AutofocusTileSink& sink, int tileSize, int halo, std::atomic<long long>& pixelsRead)
+        : autofocus(autofocus), source(source), sink(sink), tileSize(tileSize), halo(halo), pixelsRead(pixelsRead) {}
+
+    void operator()(const cv::Range& range) const override
+    {
+        cv::Size size = source.size();
+        int columns = (size.width + tileSize - 1) / tileSize;
+        cv::Mat crop, cropField; // reused for every tile of this range, run splits the tiles into a few ranges per thread
+
+        for (int i = range.start; i < range.end; i++)
+        {
+            cv::Rect tile = cv::Rect((i % columns) * tileSize, (i / columns) * tileSize, tileSize, tileSize) & cv::Rect(cv::Point(0, 0), size);
+            cv::Rect cropRect = cv::Rect(tile.x - halo, tile.y - halo, tile.width + 2 * halo, tile.height + 2 * halo) & cv::Rect(cv::Point(0, 0), size);
+
+            source.read(cropRect, crop);
+            pixelsRead += cropRect.area();
+
+            // the crop border is only the image border where the crop touches it, the rest of it is inside the halo
+            // and never reaches the tile
+            autofocus.process(crop, cropField);
+            sink.write(tile, cropField(tile - cropRect.tl()));
+        }
+    }
+
+private:
+    Autofocus& autofocus;
+    AutofocusTileSource& source;
+    AutofocusTileSink& sink;
+    int tileSize;
+    int halo;
+    std::atomic<long long>& pixelsRead;
+};
+
+AutofocusTiled::Stats AutofocusTiled::run(AutofocusTileSource& source, AutofocusTileSink& sink)
+{
+    cv::Size size = source.size();
+    CV_Assert(size.width >= 3 && size.height >= 3);
+
+    Stats stats;
+    stats.tiles = ((size.width + tileSize - 1) / tileSize) * ((size.height + tileSize - 1) / tileSize);
+    stats.halo = halo;
+
+    std::atomic<long long> pixelsRead(0);
+    cv::int64 start = cv::getTickCount();
+    // without nstripes every range would be a single tile and allocate its crop buffers again. a few stripes per
+    // thread still balance tiles that take longer (edge tiles are smaller, a slow tile source)
+    int stripes = std::min(stats.tiles, 4 * std::max(1, cv::getNumThreads()));
+    cv::parallel_for_(cv::Range(0, stats.tiles), TileBody(autofocus, source, sink, tileSize, halo, pixelsRead), stripes);
+    stats.seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+    stats.readAmplification = (double)pixelsRead / ((double)size.width * size.height);
+    return stats;
+}
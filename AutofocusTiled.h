@@ -0,0 +1,128 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <list>
+#include <mutex>
+#include "Autofocus.h"
+
+// out of core autofocus for images that do not fit in memory (aerial / microscopy scans). the image is read through a
+// tile source, every output tile is computed from its own crop (the tile plus the halo of the most blurred level and
+// the 3x3 stencil, see AutofocusPyramid::haloRadius) and written straight to a tile sink. nothing of the size of the
+// image is ever allocated, peak memory is about threads * (crop pixels * (levels + float buffers)) whatever the image
+// size. tiles give the same result as a full image run (exactly for the gaussian pyramid).
+
+class AutofocusTileSource
+{
+public:
+    virtual ~AutofocusTileSource() {}
+    virtual cv::Size size() const = 0;
+    virtual int type() const = 0;
+    // fills pixels (reusing its buffer if it fits) with the region of the image, called from several threads at once
+    virtual void read(const cv::Rect& region, cv::Mat& pixels) = 0;
+};
+
+class AutofocusTileSink
+{
+public:
+    virtual ~AutofocusTileSink() {}
+    // regions are the output tiles, they never overlap. called from several threads at once.
+    virtual void write(const cv::Rect& region, const cv::Mat& field) = 0;
+};
+
+// headerless interleaved raw file (rows * cols * elemSize bytes) mapped into memory, the os pages it in and out.
+// works as a source and, opened writable, as a sink (the file is created / resized to fit).
+class MappedRawImage : public AutofocusTileSource, public AutofocusTileSink
+{
+public:
+    MappedRawImage(const std::string& path, cv::Size size, int type, bool writable = false);
+    ~MappedRawImage();
+
+    cv::Size size() const override { return imageSize; }
+    int type() const override { return imageType; }
+    void read(const cv::Rect& region, cv::Mat& pixels) override;
+    void write(const cv::Rect& region, const cv::Mat& field) override;
+
+    // the whole file as a mat header, no copy
+    cv::Mat view() const { return cv::Mat(imageSize, imageType, mapped); }
+
+private:
+    cv::Size imageSize;
+    int imageType;
+    size_t bytes = 0;
+    uchar* mapped = nullptr;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#else
+    int file = -1;
+#endif
+
+    MappedRawImage(const MappedRawImage&) = delete;
+    MappedRawImage& operator=(const MappedRawImage&) = delete;
+};
+
+// image stored as a grid of tile files (any format imread knows), named by a printf pattern with the tile row and
+// column, e.g. "scan/%d_%d.png". tiles are decoded on demand, the last cachedTiles of them are kept since neighboring
+// crops share their halo tiles.
+class TileFileSource : public AutofocusTileSource
+{
+public:
+    TileFileSource(const std::string& pattern, cv::Size imageSize, int tileSize, int type, int cachedTiles = 16);
+
+    cv::Size size() const override { return imageSize; }
+    int type() const override { return imageType; }
+    void read(const cv::Rect& region, cv::Mat& pixels) override;
+
+private:
+    std::string pattern;
+    cv::Size imageSize;
+    int tileSize;
+    int imageType;
+    size_t cachedTiles;
+
+    struct CachedTile { cv::Point index; cv::Mat pixels; };
+    std::list<CachedTile> cache; // most recently used first
+    std::mutex cacheLock;
+
+    cv::Mat loadTile(cv::Point index);
+};
+
+// writes every output tile to its own file, named like TileFileSource names them. CV_8UC3 tiles go through imwrite,
+// CV_32FC2 fields are written raw.
+class TileFileSink : public AutofocusTileSink
+{
+public:
+    TileFileSink(const std::string& pattern, int tileSize) : pattern(pattern), tileSize(tileSize) {}
+    void write(const cv::Rect& region, const cv::Mat& field) override;
+
+private:
+    std::string pattern;
+    int tileSize;
+};
+
+class AutofocusTiled
+{
+public:
+    struct Stats
+    {
+        int tiles = 0;
+        int halo = 0; // pixels read around every tile
+        double readAmplification = 0.0; // pixels read / pixels of the image, the cost of the halos
+        double seconds = 0.0;
+    };
+
+    // settings.lastLevel / outputType / blur mode work as in Autofocus, early termination is not allowed since it would
+    // make tiles disagree at their seams
+    AutofocusTiled(const Autofocus::Settings& settings = Autofocus::Settings(), int tileSize = 1024);
+
+    // output tiles are tileSize aligned, the sink gets tiles of settings.outputType
+    Stats run(AutofocusTileSource& source, AutofocusTileSink& sink);
+
+private:
+    Autofocus autofocus;
+    int tileSize;
+    int halo;
+
+    class TileBody;
+};
@@ -28,6 +28,8 @@ public:
         decayMemory();
 
         int halfK = kernelSize / 2;
+        batchRows.clear();
+        batchY.clear();
 
         for (int y = halfK; y < height() - halfK; ++y) 
         {
@@ -42,17 +44,29 @@ public:
                 const auto& embedding = lowerDB.getDiscreteEmbedding(clusterId);
                 memKernel.insert(memKernel.end(), embedding.begin(), embedding.end());
 
-                int result = database.classify(memKernel);
                 if (isLearning)
                 {
                     database.addPattern(memKernel);
                 }
+                else if (memKernel.size() == database.getDimension())
+                {
+                    // the database does not change while classifying, so the whole column goes in one batch below
+                    batchRows.insert(batchRows.end(), memKernel.begin(), memKernel.end());
+                    batchY.push_back(y);
+                }
                 else
                 {
-                    classification[y] = result;
+                    classification[y] = database.classify(memKernel);
                 }
             }
         }
+
+        if (!batchY.empty())
+        {
+            database.classifyBatch(batchRows.data(), batchY.size(), batchMatches);
+            for (size_t i = 0; i < batchY.size(); ++i)
+                classification[batchY[i]] = batchMatches[i].cluster;
+        }
     }
 
     int classifyAt(int y) const 
@@ -83,6 +97,11 @@ private:
     PatternDatabase database;
     bool isLearning;
 
+    // memory kernels of a step waiting for classifyBatch, and their rows
+    std::vector<float> batchRows;
+    std::vector<int> batchY;
+    std::vector<ClusterMatch> batchMatches;
+
     void decayMemory() 
     {
         for (float& val : memory)
@@ -1 +1,547 @@
 #include "PatternDatabase.h"
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PATTERN_DATABASE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// avx2 + fma for the dot products of classifyBatch, compiled in with a target attribute and picked at run time
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PATTERN_DATABASE_AVX2 1
+#include <immintrin.h>
+#endif
+
+float PatternDatabase::squaredDistanceBound(float threshold)
+{
+    // sqrt rounds, so threshold * threshold can be a step off either way. walk to the exact float boundary so that
+    // sum <= bound is the same test as sqrt(sum) <= threshold.
+    if (!(threshold >= 0.0f))
+        return -1.0f;
+    float bound = threshold * threshold;
+    while (bound > 0.0f && std::sqrt(bound) > threshold)
+        bound = std::nextafter(bound, 0.0f);
+    while (bound < std::numeric_limits<float>::infinity() && std::sqrt(std::nextafter(bound, std::numeric_limits<float>::infinity())) <= threshold)
+        bound = std::nextafter(bound, std::numeric_limits<float>::infinity());
+    return bound;
+}
+
+void PatternDatabase::storeCentroid(size_t index)
+{
+    const std::vector<float>& centroid = clusters[index].centroid;
+    if (dimension == 0)
+        dimension = centroid.size();
+
+    size_t block = index / blockWidth, lane = index % blockWidth;
+    if (centroidBlocks.size() < (block + 1) * blockWidth * dimension)
+        centroidBlocks.resize((block + 1) * blockWidth * dimension, 0.0f);
+
+    if (centroidNorms.size() < (block + 1) * blockWidth)
+        centroidNorms.resize((block + 1) * blockWidth, 0.0f);
+
+    float* out = &centroidBlocks[block * blockWidth * dimension + lane];
+    float norm = 0.0f;
+    for (size_t d = 0; d < dimension; d++)
+    {
+        out[d * blockWidth] = d < centroid.size() ? centroid[d] : 0.0f;
+        norm += out[d * blockWidth] * out[d * blockWidth];
+    }
+    centroidNorms[block * blockWidth + lane] = norm;
+
+    if (indexed)
+        indexCentroid(index);
+}
+
+// squared distances of pattern to the 8 centroids of a block. sums only ever grow, so the block is dropped (false) as
+// soon as every partial sum is past bound.
+static bool blockDistances(const float* block, const float* pattern, size_t dimension, float bound, float* sums)
+{
+    const size_t width = PatternDatabase::blockWidth;
+    const size_t earlyExitDims = 4; // dimensions between the checks
+#ifdef PATTERN_DATABASE_SSE2
+    __m128 sumLow = _mm_setzero_ps(), sumHigh = _mm_setzero_ps(), limit = _mm_set1_ps(bound);
+    for (size_t d = 0; d < dimension; d++)
+    {
+        __m128 p = _mm_set1_ps(pattern[d]);
+        __m128 low = _mm_sub_ps(_mm_load_ps(block + d * width), p);
+        __m128 high = _mm_sub_ps(_mm_load_ps(block + d * width + 4), p);
+        sumLow = _mm_add_ps(sumLow, _mm_mul_ps(low, low));
+        sumHigh = _mm_add_ps(sumHigh, _mm_mul_ps(high, high));
+        if (d % earlyExitDims == earlyExitDims - 1 && !_mm_movemask_ps(_mm_or_ps(_mm_cmple_ps(sumLow, limit), _mm_cmple_ps(sumHigh, limit))))
+            return false;
+    }
+    _mm_store_ps(sums, sumLow);
+    _mm_store_ps(sums + 4, sumHigh);
+#else
+    std::fill(sums, sums + width, 0.0f);
+    for (size_t d = 0; d < dimension; d++)
+    {
+        bool anyLeft = false;
+        for (size_t k = 0; k < width; k++)
+        {
+            float diff = block[d * width + k] - pattern[d];
+            sums[k] += diff * diff;
+            anyLeft = anyLeft || sums[k] <= bound;
+        }
+        if (d % earlyExitDims == earlyExitDims - 1 && !anyLeft)
+            return false;
+    }
+#endif
+    return true;
+}
+
+int PatternDatabase::nearestCluster(const float* pattern) const
+{
+    if (indexed)
+        return nearestClusterIndexed(pattern);
+
+    // bound starts at the threshold and drops to the best sum so far, a later cluster with the same distance did not
+    // replace the earlier one either
+    float bound = squaredThreshold;
+    float bestDist = std::numeric_limits<float>::max();
+    int bestIndex = -1;
+
+    for (size_t first = 0; first < clusters.size(); first += blockWidth)
+    {
+        alignas(16) float sums[blockWidth];
+        if (!blockDistances(centroidBlocks.data() + first / blockWidth * blockWidth * dimension, pattern, dimension, bound, sums))
+            continue;
+
+        size_t lanes = std::min(blockWidth, clusters.size() - first);
+        for (size_t k = 0; k < lanes; k++)
+        {
+            if (!(sums[k] <= bound))
+                continue;
+            float dist = std::sqrt(sums[k]);
+            if (dist < bestDist)
+            {
+                bestDist = dist;
+                bestIndex = static_cast<int>(first + k);
+                bound = sums[k];
+            }
+        }
+    }
+
+    return bestIndex;
+}
+
+// rows of classifyBatch that go through a block together, the dot products of all of them come from one pass over it
+static const size_t batchRows = 4;
+
+// dots[r * blockWidth + k] = rows[r] . centroid k of the block, for batchRows rows
+static void blockDots(const float* block, const float* const* rows, size_t dimension, float* dots)
+{
+    const size_t width = PatternDatabase::blockWidth;
+#ifdef PATTERN_DATABASE_SSE2
+    __m128 low[batchRows], high[batchRows];
+    for (size_t r = 0; r < batchRows; r++)
+        low[r] = high[r] = _mm_setzero_ps();
+    for (size_t d = 0; d < dimension; d++)
+    {
+        __m128 centroidLow = _mm_load_ps(block + d * width);
+        __m128 centroidHigh = _mm_load_ps(block + d * width + 4);
+        for (size_t r = 0; r < batchRows; r++)
+        {
+            __m128 p = _mm_set1_ps(rows[r][d]);
+            low[r] = _mm_add_ps(low[r], _mm_mul_ps(centroidLow, p));
+            high[r] = _mm_add_ps(high[r], _mm_mul_ps(centroidHigh, p));
+        }
+    }
+    for (size_t r = 0; r < batchRows; r++)
+    {
+        _mm_store_ps(dots + r * width, low[r]);
+        _mm_store_ps(dots + r * width + 4, high[r]);
+    }
+#else
+    std::fill(dots, dots + batchRows * width, 0.0f);
+    for (size_t d = 0; d < dimension; d++)
+        for (size_t r = 0; r < batchRows; r++)
+            for (size_t k = 0; k < width; k++)
+                dots[r * width + k] += block[d * width + k] * rows[r][d];
+#endif
+}
+
+#ifdef PATTERN_DATABASE_AVX2
+// blockDots with one register per centroid row and the row values broadcast straight from memory. two sets of sums
+// for even and odd dimensions keep 8 fma chains going.
+__attribute__((target("avx2,fma")))
+static void blockDotsAVX2(const float* block, const float* const* rows, size_t dimension, float* dots)
+{
+    const size_t width = PatternDatabase::blockWidth;
+    __m256 even[batchRows], odd[batchRows];
+    for (size_t r = 0; r < batchRows; r++)
+        even[r] = odd[r] = _mm256_setzero_ps();
+    size_t d = 0;
+    for (; d + 1 < dimension; d += 2)
+    {
+        __m256 first = _mm256_load_ps(block + d * width);
+        __m256 second = _mm256_load_ps(block + (d + 1) * width);
+        for (size_t r = 0; r < batchRows; r++)
+        {
+            even[r] = _mm256_fmadd_ps(first, _mm256_broadcast_ss(rows[r] + d), even[r]);
+            odd[r] = _mm256_fmadd_ps(second, _mm256_broadcast_ss(rows[r] + d + 1), odd[r]);
+        }
+    }
+    if (d < dimension)
+    {
+        __m256 last = _mm256_load_ps(block + d * width);
+        for (size_t r = 0; r < batchRows; r++)
+            even[r] = _mm256_fmadd_ps(last, _mm256_broadcast_ss(rows[r] + d), even[r]);
+    }
+    for (size_t r = 0; r < batchRows; r++)
+        _mm256_store_ps(dots + r * width, _mm256_add_ps(even[r], odd[r]));
+}
+#endif
+
+// bit k set if centroid k of the block may be within bound. |x|^2 + |c|^2 - 2 x.c is the squared distance up to
+// rounding, slack * (|x|^2 + |c|^2) covers that rounding and the one of the summed differences blockDistances gets,
+// so a centroid left out here would have failed the exact test as well.
+static int candidateLanes(const float* dots, float rowNorm, const float* norms, float slack, float bound)
+{
+#ifdef PATTERN_DATABASE_SSE2
+    __m128 x = _mm_set1_ps(rowNorm), factor = _mm_set1_ps(slack), limit = _mm_set1_ps(bound), two = _mm_set1_ps(2.0f);
+    int lanes = 0;
+    for (int half = 0; half < 2; half++)
+    {
+        __m128 both = _mm_add_ps(x, _mm_load_ps(norms + 4 * half));
+        __m128 approx = _mm_sub_ps(both, _mm_mul_ps(two, _mm_load_ps(dots + 4 * half)));
+        lanes |= _mm_movemask_ps(_mm_cmple_ps(_mm_sub_ps(approx, _mm_mul_ps(factor, both)), limit)) << (4 * half);
+    }
+    return lanes;
+#else
+    int lanes = 0;
+    for (size_t k = 0; k < PatternDatabase::blockWidth; k++)
+    {
+        float both = rowNorm + norms[k];
+        if (both - 2.0f * dots[k] - slack * both <= bound)
+            lanes |= 1 << k;
+    }
+    return lanes;
+#endif
+}
+
+void PatternDatabase::classifyBatch(const float* patterns, size_t count, size_t k, std::vector<ClusterMatch>& matches, BatchKernel kernel) const
+{
+    const ClusterMatch none = { -1, std::numeric_limits<float>::infinity() };
+    matches.assign(count * k, none);
+    if (k == 0 || clusters.empty())
+        return;
+
+    // tileRows rows run over chunkBytes of centroid blocks at a time, so the chunk stays in L1 for all of them and the
+    // rows stay in L2 for every chunk. inside a chunk batchRows rows share each pass over a block (DotProducts).
+    const size_t tileRows = 64;
+    const size_t chunkBytes = 16 * 1024;
+    const size_t blockCount = (clusters.size() + blockWidth - 1) / blockWidth;
+    const size_t chunkBlocks = std::max<size_t>(1, chunkBytes / (blockWidth * dimension * sizeof(float)));
+    const float slack = 4.0f * (dimension + 4) * std::numeric_limits<float>::epsilon();
+#ifdef PATTERN_DATABASE_AVX2
+    static const bool useAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+
+    // per row of the tile: squared distances of its matches, how many there are, the squared distance of the k-th
+    // match once there are k (the threshold before that), |row|^2
+    std::vector<float> matchSums(tileRows * k), bounds(tileRows), rowNorms(tileRows);
+    std::vector<size_t> filled(tileRows);
+    for (size_t tile = 0; tile < count; tile += tileRows)
+    {
+        size_t rows = std::min(tileRows, count - tile);
+        for (size_t row = 0; row < rows; row++)
+        {
+            const float* pattern = patterns + (tile + row) * dimension;
+            rowNorms[row] = 0.0f;
+            for (size_t d = 0; d < dimension; d++)
+                rowNorms[row] += pattern[d] * pattern[d];
+            bounds[row] = squaredThreshold;
+            filled[row] = 0;
+        }
+
+        for (size_t chunk = 0; chunk < blockCount; chunk += chunkBlocks)
+        {
+            size_t chunkEnd = std::min(blockCount, chunk + chunkBlocks);
+            for (size_t group = 0; group < rows; group += batchRows)
+            {
+                // a short last group repeats its last row, the copies are not looked at
+                size_t groupSize = std::min(batchRows, rows - group);
+                const float* groupPatterns[batchRows];
+                for (size_t r = 0; r < batchRows; r++)
+                    groupPatterns[r] = patterns + (tile + group + std::min(r, groupSize - 1)) * dimension;
+
+                for (size_t block = chunk; block < chunkEnd; block++)
+                {
+                    const float* centroids = centroidBlocks.data() + block * blockWidth * dimension;
+                    alignas(32) float dots[batchRows * blockWidth];
+                    if (kernel == DotProducts)
+                    {
+#ifdef PATTERN_DATABASE_AVX2
+                        if (useAVX2)
+                            blockDotsAVX2(centroids, groupPatterns, dimension, dots);
+                        else
+#endif
+                            blockDots(centroids, groupPatterns, dimension, dots);
+                    }
+
+                    // blocks come in index order for every row, so bounds and ties go exactly as in nearestCluster.
+                    // the dot products only rule centroids out, the sums that count are the exact ones of the scan
+                    size_t first = block * blockWidth;
+                    size_t lanes = std::min(blockWidth, clusters.size() - first);
+                    for (size_t r = 0; r < groupSize; r++)
+                    {
+                        size_t row = group + r;
+                        float& bound = bounds[row];
+                        if (kernel == DotProducts && !(candidateLanes(dots + r * blockWidth, rowNorms[row], &centroidNorms[first], slack, bound) & ((1 << lanes) - 1)))
+                            continue;
+                        alignas(16) float sums[blockWidth];
+                        if (!blockDistances(centroids, groupPatterns[r], dimension, bound, sums))
+                            continue;
+
+                        // a later cluster only gets past an equal distance if it is nearer
+                        ClusterMatch* list = &matches[(tile + row) * k];
+                        float* listSums = &matchSums[row * k];
+                        for (size_t lane = 0; lane < lanes; lane++)
+                        {
+                            float sum = sums[lane];
+                            if (!(sum <= bound))
+                                continue;
+                            float dist = std::sqrt(sum);
+                            size_t position = filled[row];
+                            if (position == k)
+                            {
+                                if (!(dist < list[k - 1].distance))
+                                    continue;
+                                position = k - 1;
+                            }
+                            else
+                                filled[row]++;
+                            for (; position > 0 && dist < list[position - 1].distance; position--)
+                            {
+                                list[position] = list[position - 1];
+                                listSums[position] = listSums[position - 1];
+                            }
+                            list[position] = { static_cast<int>(first + lane), dist };
+                            listSums[position] = sum;
+                            if (filled[row] == k)
+                                bound = listSums[k - 1];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// squared distance in the same order as the block scan, stops early once it is past bound
+static inline bool squaredDistanceWithin(const float* centroid, const float* pattern, size_t dimension, float bound, float& sum)
+{
+    sum = 0.0f;
+    for (size_t d = 0; d < dimension; d++)
+    {
+        float diff = centroid[d] - pattern[d];
+        sum += diff * diff;
+        if ((d & 3) == 3 && sum > bound)
+            return false;
+    }
+    return sum <= bound;
+}
+
+int PatternDatabase::nearestClusterIndexed(const float* pattern) const
+{
+    // the tree does not visit clusters in index order, so an equal distance wins if its index is lower and bound is
+    // the largest sum with the best distance, not the best sum itself
+    float bound = squaredThreshold;
+    float bestDist = std::numeric_limits<float>::max();
+    int bestIndex = -1;
+    auto consider = [&](int index, const float* centroid)
+    {
+        float sum;
+        if (!squaredDistanceWithin(centroid, pattern, dimension, bound, sum))
+            return;
+        float dist = std::sqrt(sum);
+        if (dist < bestDist || (dist == bestDist && index < bestIndex))
+        {
+            if (dist < bestDist)
+                bound = squaredDistanceBound(dist);
+            bestDist = dist;
+            bestIndex = index;
+        }
+    };
+
+    // squared distance to a node's box, summed in the same order as the distances, so it never exceeds the distance
+    // of a cluster inside the box
+    auto boxDistanceWithin = [&](int node)
+    {
+        const float* low = &treeBounds[node * 2 * dimension];
+        const float* high = low + dimension;
+        float sum = 0.0f;
+        for (size_t d = 0; d < dimension; d++)
+        {
+            float gap = pattern[d] < low[d] ? low[d] - pattern[d] : (pattern[d] > high[d] ? pattern[d] - high[d] : 0.0f);
+            sum += gap * gap;
+            if (sum > bound)
+                return false;
+        }
+        return true;
+    };
+
+    if (!treeNodes.empty())
+    {
+        // median splits keep the tree balanced, the stack never holds more than its depth + 1 nodes
+        int stack[128];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const TreeNode& node = treeNodes[stack[--stackSize]];
+            if (!boxDistanceWithin(static_cast<int>(&node - treeNodes.data())))
+                continue;
+
+            if (node.left == -1)
+            {
+                for (int i = node.begin; i < node.end; i++)
+                {
+                    if (treePosition[treeOrder[i]] == i)
+                        consider(treeOrder[i], &treeCentroids[i * dimension]);
+                }
+                continue;
+            }
+
+            // near side last, so it is searched first
+            bool nearLeft = pattern[node.axis] <= node.split;
+            stack[stackSize++] = nearLeft ? node.right : node.left;
+            stack[stackSize++] = nearLeft ? node.left : node.right;
+        }
+    }
+
+    for (int index : unindexed)
+        consider(index, clusters[index].centroid.data());
+
+    return bestIndex;
+}
+
+void PatternDatabase::indexCentroid(size_t index)
+{
+    if (index >= treePosition.size())
+    {
+        treePosition.resize(index + 1, -1);
+        unindexed.push_back(static_cast<int>(index));
+    }
+    else if (treePosition[index] >= 0 && !moveInTree(index))
+    {
+        treePosition[index] = -1;
+        unindexed.push_back(static_cast<int>(index));
+    }
+
+    // every search scans the list, so it stays a small part of the tree. a rebuild every size / 64 changes still only
+    // costs a few log(size) distance computations per change.
+    if (unindexed.size() > 32 + treeOrder.size() / 64)
+        rebuildIndex();
+}
+
+bool PatternDatabase::moveInTree(size_t index)
+{
+    // update only nudges a centroid, mostly it is still on the same side of every split down to its leaf. then it
+    // stays, and the boxes on the way grow to take it in.
+    const std::vector<float>& centroid = clusters[index].centroid;
+    int position = treePosition[index];
+    int path[128];
+    int depth = 0;
+    int node = 0;
+    for (;;)
+    {
+        path[depth++] = node;
+        const TreeNode& n = treeNodes[node];
+        if (n.left == -1)
+            break;
+        bool left = position < treeNodes[n.left].end;
+        if (left ? centroid[n.axis] > n.split : centroid[n.axis] < n.split)
+            return false;
+        node = left ? n.left : n.right;
+    }
+
+    std::copy(centroid.begin(), centroid.begin() + dimension, treeCentroids.begin() + position * dimension);
+    for (int i = 0; i < depth; i++)
+    {
+        float* low = &treeBounds[path[i] * 2 * dimension];
+        float* high = low + dimension;
+        for (size_t d = 0; d < dimension; d++)
+        {
+            low[d] = std::min(low[d], centroid[d]);
+            high[d] = std::max(high[d], centroid[d]);
+        }
+    }
+    return true;
+}
+
+void PatternDatabase::rebuildIndex()
+{
+    treeNodes.clear();
+    treeBounds.clear();
+    treeOrder.resize(clusters.size());
+    for (size_t i = 0; i < clusters.size(); i++)
+        treeOrder[i] = static_cast<int>(i);
+    if (!clusters.empty())
+        buildNode(0, static_cast<int>(clusters.size()));
+
+    treePosition.assign(clusters.size(), -1);
+    treeCentroids.resize(clusters.size() * dimension);
+    for (size_t i = 0; i < treeOrder.size(); i++)
+    {
+        treePosition[treeOrder[i]] = static_cast<int>(i);
+        const std::vector<float>& centroid = clusters[treeOrder[i]].centroid;
+        std::copy(centroid.begin(), centroid.begin() + dimension, treeCentroids.begin() + i * dimension);
+    }
+    unindexed.clear();
+}
+
+int PatternDatabase::buildNode(int begin, int end)
+{
+    int nodeIndex = static_cast<int>(treeNodes.size());
+    treeNodes.push_back({ begin, end, 0, 0.0f, -1, -1 });
+
+    // bounding box, its widest axis is where the node splits
+    treeBounds.resize(treeBounds.size() + 2 * dimension);
+    float* low = &treeBounds[nodeIndex * 2 * dimension];
+    float* high = low + dimension;
+    int axis = 0;
+    float widest = 0.0f;
+    for (size_t d = 0; d < dimension; d++)
+    {
+        low[d] = std::numeric_limits<float>::max();
+        high[d] = -std::numeric_limits<float>::max();
+        for (int i = begin; i < end; i++)
+        {
+            low[d] = std::min(low[d], clusters[treeOrder[i]].centroid[d]);
+            high[d] = std::max(high[d], clusters[treeOrder[i]].centroid[d]);
+        }
+        if (high[d] - low[d] > widest)
+        {
+            widest = high[d] - low[d];
+            axis = static_cast<int>(d);
+        }
+    }
+    if (end - begin <= leafSize || widest <= 0.0f)
+        return nodeIndex; // a leaf, or all the same point
+
+    int middle = (begin + end) / 2;
+    std::nth_element(treeOrder.begin() + begin, treeOrder.begin() + middle, treeOrder.begin() + end,
+        [&](int a, int b) { return clusters[a].centroid[axis] < clusters[b].centroid[axis]; });
+    float split = clusters[treeOrder[middle]].centroid[axis];
+
+    int left = buildNode(begin, middle);
+    int right = buildNode(middle, end);
+    TreeNode& node = treeNodes[nodeIndex];
+    node.axis = axis;
+    node.split = split;
+    node.left = left;
+    node.right = right;
+    return nodeIndex;
+}
+
+void PatternDatabase::clearIndex()
+{
+    treeNodes.clear();
+    treeOrder.clear();
+    treePosition.clear();
+    treeCentroids.clear();
+    treeBounds.clear();
+    unindexed.clear();
+}
@@ -6,6 +6,32 @@
 #include <iostream>
 #include <fstream>
 #include<unordered_map>
+#include <new>
+#include <cstddef>
+
+// storage aligned for whole sse / avx registers, used for the centroid blocks
+template<typename T, size_t Alignment>
+struct AlignedAllocator
+{
+    using value_type = T;
+    template<typename U> struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template<typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+    bool operator==(const AlignedAllocator&) const { return true; }
+    bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
+// one result of classifyBatch
+struct ClusterMatch
+{
+    int cluster; // -1 if there is no cluster within the threshold
+    float distance; // infinity with cluster -1
+};
 
 struct PatternCluster 
 {
@@ -44,10 +70,32 @@ struct PatternCluster
     }
 };
 
+// all patterns (and so all centroids) have the length of the first one that was added.
+// classify / addPattern compare against every centroid, so besides the PatternCluster list the centroids are also kept
+// in centroidBlocks: blockWidth clusters per block, dimension-major inside a block (centroid component d of the block's
+// cluster k at d * blockWidth + k). the scan loads one component of 8 clusters at once, works on squared distances and
+// drops a block as soon as all 8 partial sums are past the best one so far / the threshold. the result is the same as
+// comparing sqrt distances cluster by cluster.
+//
+// with indexed set the search goes through a k-d tree over the centroids instead, pruned by the threshold, which only
+// looks at a fraction of the clusters once there are enough of them (pattern_benchmark.cpp finds the crossover).
+// the tree is rebuilt now and then, not on every change: a new cluster, or one that update moved across a split of
+// the tree, goes to a short list that every search scans one by one until the next rebuild. same results either way.
 class PatternDatabase 
 {
 public:
-    PatternDatabase(float threshold) : distanceThreshold(threshold) {}
+    static constexpr size_t blockWidth = 8;
+    static constexpr int leafSize = 8; // clusters per k-d tree leaf
+
+    // how classifyBatch rules out the centroids of a block for a row, see there
+    enum BatchKernel
+    {
+        EarlyExit, // the differences summed like classify does, the block is dropped once all 8 sums are past the bound
+        DotProducts // |x|^2 + |c|^2 - 2 x.c for 4 rows per pass over the block, only blocks with a centroid left get summed
+    };
+
+    PatternDatabase(float threshold, bool indexed = false)
+        : distanceThreshold(threshold), squaredThreshold(squaredDistanceBound(threshold)), indexed(indexed) {}
 
     const std::vector<float>& getDiscreteEmbedding(int clusterId) const 
     {
@@ -63,10 +111,12 @@ public:
         if (bestIndex != -1) 
         {
             clusters[bestIndex].update(pattern);
+            storeCentroid(bestIndex);
         }
         else 
         {
             clusters.emplace_back(pattern, nextEmbeddingId);
+            storeCentroid(clusters.size() - 1);
             std::vector<float> defaultEmbedding = generateEmbedding(nextEmbeddingId);
             embeddingTable[nextEmbeddingId] = defaultEmbedding;
             nextEmbeddingId++;
@@ -76,20 +126,34 @@ public:
     // Find the best matching cluster index, or -1 if no match
     int classify(const std::vector<float>& pattern) const
     {
-        int bestIndex = -1;
-        float bestDist = std::numeric_limits<float>::max();
+        return nearestCluster(pattern.data());
+    }
 
-        for (size_t i = 0; i < clusters.size(); ++i) 
-        {
-            float dist = euclideanDistance(clusters[i].centroid, pattern);
-            if (dist < bestDist) 
-            {
-                bestDist = dist;
-                bestIndex = static_cast<int>(i);
-            }
-        }
+    // classify for many patterns at once. patterns holds count rows of getDimension() floats each. best[i].cluster is
+    // what classify returns for row i, with its distance.
+    void classifyBatch(const float* patterns, size_t count, std::vector<ClusterMatch>& best, BatchKernel kernel = EarlyExit) const
+    {
+        classifyBatch(patterns, count, 1, best, kernel);
+    }
 
-        return (bestDist <= distanceThreshold) ? bestIndex : -1;
+    // the k nearest clusters within distanceThreshold of every row, nearest first (equal distances lowest index first),
+    // in matches[i * k] .. matches[i * k + k - 1]. rows with fewer than k are filled up with { -1, infinity }.
+    // the rows are cache tiled: 64 rows at a time go over 16 KB of centroid blocks at a time, so a block comes from L1
+    // for all of them. per row and block the kernel decides what gets computed:
+    // - EarlyExit checks the partial sums every 4 dimensions, which drops most blocks long before their last dimension
+    //   when the threshold or the k-th match is close. it runs about as fast as classify row by row.
+    // - DotProducts is the gemm form. one pass over a block gives the dot products of 4 rows with its 8 centroids (avx2
+    //   fma when the cpu has it, sse2 otherwise), and a row only sums a block exactly if |x|^2 + |c|^2 - 2 x.c (less its
+    //   rounding slack) leaves a centroid within the bound. it reads every dimension of every block, so it only wins
+    //   where the early exit hardly fires: every centroid about as far as the bound, like high dimensional embeddings
+    //   (about 2x on the sphere data of pattern_benchmark.cpp). on its uniform random patterns it is up to 3x slower.
+    // both give exactly what classify gives, the exact sums decide. the index is not used here.
+    void classifyBatch(const float* patterns, size_t count, size_t k, std::vector<ClusterMatch>& matches, BatchKernel kernel = EarlyExit) const;
+
+    // length of the patterns, 0 while the database is empty
+    size_t getDimension() const
+    {
+        return dimension;
     }
 
     const std::vector<PatternCluster>& getClusters() const 
@@ -150,6 +214,10 @@ public:
         in >> numClusters;
         clusters.clear();
         embeddingTable.clear();
+        centroidBlocks.clear();
+        centroidNorms.clear();
+        dimension = 0;
+        clearIndex();
         nextEmbeddingId = 0; // reset ID counter
 
         for (size_t i = 0; i < numClusters; ++i) {
@@ -173,6 +241,7 @@ public:
 
             clusters.emplace_back(centroid, embId);
             clusters.back().count = count;
+            storeCentroid(clusters.size() - 1);
             embeddingTable[embId] = emb;
 
             if (embId >= nextEmbeddingId)
@@ -191,37 +260,52 @@ public:
 private:
     std::vector<PatternCluster> clusters;
     float distanceThreshold;
+    float squaredThreshold; // largest squared distance whose sqrt is still <= distanceThreshold
     int nextEmbeddingId = 0; // Add this to PatternDatabase
     std::unordered_map<int, std::vector<float>> embeddingTable;
 
+    size_t dimension = 0;
+    std::vector<float, AlignedAllocator<float, 32>> centroidBlocks;
+    std::vector<float, AlignedAllocator<float, 32>> centroidNorms; // |centroid|^2, blockWidth per block like the blocks
+
+    // k-d tree, every node covers treeOrder[begin, end). left holds the clusters at or below split along axis, right
+    // the ones at or above it. leaves have left == -1. every node also has a bounding box of its clusters in
+    // treeBounds (dimension lows, then dimension highs), a search skips nodes whose box is past the best distance.
+    struct TreeNode
+    {
+        int begin, end;
+        int axis;
+        float split;
+        int left, right;
+    };
+
+    bool indexed;
+    std::vector<TreeNode> treeNodes;
+    std::vector<int> treeOrder;
+    std::vector<int> treePosition; // per cluster its place in treeOrder, -1 while it is on the unindexed list
+    std::vector<float> treeCentroids; // the centroids in treeOrder, so a leaf reads one contiguous run
+    std::vector<float> treeBounds;
+    std::vector<int> unindexed;
+
     int findClosestCluster(const std::vector<float>& pattern) const 
     {
-        float bestDist = std::numeric_limits<float>::max();
-        int bestIndex = -1;
+        return nearestCluster(pattern.data());
+    }
 
-        for (size_t i = 0; i < clusters.size(); ++i) 
-        {
-            float dist = euclideanDistance(clusters[i].centroid, pattern);
-            if (dist < bestDist) 
-            {
-                bestDist = dist;
-                bestIndex = static_cast<int>(i);
-            }
-        }
+    // copies the centroid of clusters[index] into its block, after it was added or moved
+    void storeCentroid(size_t index);
 
-        return (bestDist <= distanceThreshold) ? bestIndex : -1;
-    }
+    // index of the closest centroid if it is within distanceThreshold, -1 otherwise
+    int nearestCluster(const float* pattern) const;
 
-    static float euclideanDistance(const std::vector<float>& a, const std::vector<float>& b)
-    {
-        float sum = 0.0f;
-        for (size_t i = 0; i < a.size(); ++i) 
-        {
-            float d = a[i] - b[i];
-            sum += d * d;
-        }
-        return std::sqrt(sum);
-    }
+    static float squaredDistanceBound(float threshold);
+
+    int nearestClusterIndexed(const float* pattern) const;
+    void indexCentroid(size_t index);
+    bool moveInTree(size_t index);
+    void rebuildIndex();
+    int buildNode(int begin, int end);
+    void clearIndex();
 
     std::vector<float> generateEmbedding(int id) 
     {
@@ -0,0 +1,185 @@
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <numeric>
+#include "Autofocus.h"
+#include "AutofocusKernels.h"
+#include "AutofocusPrefetcher.h"
+
+using namespace std;
+using namespace cv;
+namespace fs = std::filesystem;
+
+// headless batch driver for servers: no imshow / waitKey. runs every input image through Autofocus and writes one
+// direction map per image, while ImagePrefetcher reads and decodes the next images in the background. prints the
+// latency of every image and the throughput of the whole run.
+//
+// usage: autofocus_batch [options] <input>...
+//   input is an image, a directory (every image in it, sorted by name) or a text file with one image path per line
+//   -o <dir>       output directory, default "autofocus_out"
+//   -f png|raw     png: the visual CV_8UC3 encoding (like autofocusresult.png), raw: the CV_32FC2 field as headerless
+//                  floats (rows * cols * 2), default png
+//   -t <n>         decoder threads, default 2
+//   -d <n>         prefetch depth (images decoded ahead), default 4
+//   --gray         decode as gray, the kernels then read a third of the bytes
+//   --box          box approximation blur levels
+//   --analytic     analytic engine (AutofocusAnalytic), no blur levels
+
+static const char* const imageExtensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tif", ".tiff", ".pgm", ".ppm" };
+
+static bool isImageFile(const fs::path& path)
+{
+    string extension = path.extension().string();
+    transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)tolower(c); });
+    return find(begin(imageExtensions), end(imageExtensions), extension) != end(imageExtensions);
+}
+
+static void collectInputs(const string& input, vector<string>& paths)
+{
+    fs::path path(input);
+    if (fs::is_directory(path))
+    {
+        vector<string> found;
+        for (const auto& entry : fs::directory_iterator(path))
+            if (entry.is_regular_file() && isImageFile(entry.path()))
+                found.push_back(entry.path().string());
+        sort(found.begin(), found.end());
+        paths.insert(paths.end(), found.begin(), found.end());
+    }
+    else if (isImageFile(path))
+        paths.push_back(input);
+    else
+    {
+        ifstream list(input);
+        if (!list)
+        {
+            cerr << "can not open " << input << endl;
+            return;
+        }
+        for (string line; getline(list, line);)
+        {
+            line.erase(line.find_last_not_of(" \r\t") + 1);
+            if (!line.empty())
+                paths.push_back(line);
+        }
+    }
+}
+
+static void printUsage()
+{
+    cerr << "usage: autofocus_batch [-o dir] [-f png|raw] [-t threads] [-d depth] [--gray] [--box] [--analytic] <image | directory | list>..." << endl;
+}
+
+static bool writeRaw(const string& path, const Mat& field)
+{
+    ofstream file(path, ios::binary);
+    for (int y = 0; y < field.rows && file; y++)
+        file.write(field.ptr<char>(y), field.cols * field.elemSize());
+    return file.good();
+}
+
+int main(int argc, char** argv)
+{
+    string outputDirectory = "autofocus_out";
+    string format = "png";
+    int threads = 2, depth = 4;
+    int imreadFlags = IMREAD_COLOR;
+    Autofocus::Settings settings;
+    vector<string> paths;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-o" && hasValue)
+            outputDirectory = argv[++i];
+        else if (arg == "-f" && hasValue)
+            format = argv[++i];
+        else if (arg == "-t" && hasValue)
+            threads = max(1, atoi(argv[++i]));
+        else if (arg == "-d" && hasValue)
+            depth = max(1, atoi(argv[++i]));
+        else if (arg == "--gray")
+            imreadFlags = IMREAD_GRAYSCALE;
+        else if (arg == "--box")
+            settings.blurMode = AutofocusPyramid::BoxApproximation;
+        else if (arg == "--analytic")
+            settings.engine = Autofocus::AnalyticDerivatives;
+        else if (!arg.empty() && arg[0] == '-')
+        {
+            printUsage();
+            return 1;
+        }
+        else
+            collectInputs(arg, paths);
+    }
+    if (paths.empty() || (format != "png" && format != "raw"))
+    {
+        printUsage();
+        return 1;
+    }
+
+    settings.outputType = format == "png" ? CV_8UC3 : CV_32FC2;
+    fs::create_directories(outputDirectory);
+    Autofocus autofocus(settings);
+    ImagePrefetcher prefetcher(paths, imreadFlags, threads, depth);
+
+    vector<double> latencies;
+    double megapixels = 0.0;
+    int failed = 0;
+    Mat field;
+    int64 start = getTickCount();
+    for (;;)
+    {
+        // latency of an image is what the main thread spends on it: waiting for the prefetcher (0 once it is ahead),
+        // the autofocus pass and the write
+        int64 imageStart = getTickCount();
+        const ImagePrefetcher::Image* image = prefetcher.next();
+        if (!image)
+            break;
+        double waitMs = (getTickCount() - imageStart) * 1000.0 / getTickFrequency();
+
+        if (image->image.empty())
+        {
+            cerr << image->path << ": can not read" << endl;
+            failed++;
+            continue;
+        }
+
+        int64 processStart = getTickCount();
+        autofocus.process(image->image, field);
+        double processMs = (getTickCount() - processStart) * 1000.0 / getTickFrequency();
+
+        string output = (fs::path(outputDirectory) / (fs::path(image->path).stem().string() + "_directions." + format)).string();
+        bool written = format == "png" ? imwrite(output, field) : writeRaw(output, field);
+        if (!written)
+        {
+            cerr << output << ": can not write" << endl;
+            failed++;
+        }
+
+        double latencyMs = (getTickCount() - imageStart) * 1000.0 / getTickFrequency();
+        latencies.push_back(latencyMs);
+        megapixels += image->image.total() / 1e6;
+        cout << image->path << " " << image->image.cols << "x" << image->image.rows << ": " << latencyMs << " ms (wait " << waitMs
+            << ", load " << image->loadMs << " in background, autofocus " << processMs << ")" << endl;
+    }
+    double seconds = (getTickCount() - start) / getTickFrequency();
+
+    if (!latencies.empty())
+    {
+        vector<double> sorted = latencies;
+        sort(sorted.begin(), sorted.end());
+        double mean = accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+        cout << latencies.size() << " images in " << seconds << " s: " << latencies.size() / seconds << " images/s, " << megapixels / seconds
+            << " Mpix/s" << endl;
+        cout << "latency ms: mean " << mean << ", median " << sorted[sorted.size() / 2] << ", p95 " << sorted[min(sorted.size() - 1, sorted.size() * 95 / 100)]
+            << ", max " << sorted.back() << endl;
+    }
+    if (failed)
+        cout << failed << " images failed" << endl;
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,595 @@
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include "json.hpp"
+#include "AutofocusPyramid.h"
+#include "AutofocusKernels.h"
+#include "AutofocusFixedPoint.h"
+#include "Autofocus.h"
+#include "AutofocusImpulses.h"
+#include "AutofocusEnergy.h"
+
+using namespace std;
+using namespace cv;
+using json = nlohmann::json;
+
+// headless benchmark / regression run for the autofocus kernels, no imshow / waitKey.
+// every kernel variant in kernelVariants is timed on single level pairs and on the full level loop, over the real test
+// levels (autofocustest1/*.png) and synthetic frames at several resolutions and level counts. results go to
+// benchmarkJson as json. the real levels are also run through the same loop as autofocus_clean.cpp and checked against
+// the committed autofocusresult.png, exact variants have to match it bit for bit.
+// new kernels get benchmarked by adding a line to kernelVariants.
+
+const string benchmarkJson = "autofocus_benchmark.json";
+const int repeats = 5; // every timing is the median of this many runs
+const int realLevelCount = 9;
+const int syntheticLevelCounts[] = { 5, 9 };
+const Size resolutions[] = { Size(0, 0), Size(1920, 1080), Size(3840, 2160) }; // 0x0 is the native size of the test set
+
+struct KernelVariant
+{
+    string name;
+    int outputType; // CV_8UC3, CV_32FC2 or packed CV_8UC1, fields and packed maps are encoded before they are compared
+    bool exact; // has to reproduce autofocusresult.png exactly
+    bool bgrOnly; // the levels are converted to bgr (untimed) before they are passed in
+    function<void(const Mat& prev, const Mat& curr, Mat& out)> run;
+};
+
+StimuliActiveRuns sparseRuns; // kept across calls like autofocus_clean.cpp does
+
+const vector<KernelVariant> kernelVariants =
+{
+    { "reference", CV_8UC3, true, true, GetStimuliReference },
+    { "simd", CV_8UC3, true, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuli(p, c, o); } },
+    { "simd_parallel", CV_8UC3, true, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuliParallel(p, c, o); } },
+    { "simd_field", CV_32FC2, true, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuli(p, c, o); } },
+    { "simd_packed", CV_8UC1, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuli(p, c, o); } },
+    { "simd_packed_parallel", CV_8UC1, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuliParallel(p, c, o); } },
+    { "stencil4", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuli(p, c, o, Stencil4); } },
+    { "stencil16", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuli(p, c, o, Stencil16); } },
+    { "stencil24", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuli(p, c, o, Stencil24); } },
+    { "stencil24_parallel", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuliParallel(p, c, o, 32, Stencil24); } },
+    { "sparse_eps0", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { BuildStimuliActiveRuns(p, c, 0, sparseRuns); GetStimuliSparse(p, c, o, sparseRuns); } },
+    { "sparse_eps4", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { BuildStimuliActiveRuns(p, c, 4, sparseRuns); GetStimuliSparse(p, c, o, sparseRuns); } },
+    { "fixed_point", CV_8UC3, false, false, GetStimuliFixedPoint },
+    { "fixed_point_parallel", CV_8UC3, false, false, [](const Mat& p, const Mat& c, Mat& o) { GetStimuliFixedPointParallel(p, c, o); } },
+};
+
+static double Milliseconds(int64 ticks)
+{
+    return ticks * 1000.0 / getTickFrequency();
+}
+
+static double MedianMs(const function<void()>& work)
+{
+    vector<double> times;
+    for (int r = 0; r < repeats; r++)
+    {
+        int64 start = getTickCount();
+        work();
+        times.push_back(Milliseconds(getTickCount() - start));
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// levels[0] is the least blurred one, like the png names. the test set is gray stored as 3 channel pngs, so it is
+// read both ways to cover the bgr and the gray kernels.
+static vector<Mat> ReadRealLevels(int flags)
+{
+    vector<Mat> levels;
+    for (int i = 0; i < realLevelCount; i++)
+    {
+        Mat level = imread("autofocustest1/" + to_string(i) + ".png", flags);
+        if (level.empty())
+            return vector<Mat>();
+        levels.push_back(level);
+    }
+    return levels;
+}
+
+// blocks, discs and noise so there are both flat areas and edges at every scale
+static Mat MakeSyntheticFrame(Size size, int channels)
+{
+    Mat frame(size, CV_8UC(channels), Scalar::all(96));
+    RNG rng(12345);
+    int shapes = max(8, size.area() / 4000);
+    for (int i = 0; i < shapes; i++)
+    {
+        Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        int radius = rng.uniform(4, max(5, min(size.width, size.height) / 8));
+        Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+        if (i % 2 == 0)
+            circle(frame, center, radius, color, FILLED);
+        else
+            rectangle(frame, Rect(center.x - radius, center.y - radius / 2, radius * 2, radius), color, FILLED);
+    }
+
+    Mat noise(size, frame.type());
+    randu(noise, Scalar::all(0), Scalar::all(12));
+    frame += noise;
+    frame -= Scalar::all(6);
+    return frame;
+}
+
+static Mat MakeOutput(const KernelVariant& variant, Size size)
+{
+    if (variant.outputType == CV_8UC1)
+        return Mat(PackedDirectionMapSize(size), CV_8UC1, Scalar::all(0));
+    return Mat(size, variant.outputType, Scalar::all(0));
+}
+
+// the autofocus_clean.cpp loop: pairs (levelCount - 1, levelCount - 2) down to (2, 1), out accumulated across pairs.
+// out starts cleared so the sparse variants are comparable, the dense ones overwrite the interior anyway.
+static Mat RunLevelLoop(const KernelVariant& variant, const vector<Mat>& levels, vector<double>* levelMs)
+{
+    Size size = levels[0].size();
+    Mat out = MakeOutput(variant, size);
+    ClearDirectionMap(out);
+    for (int i = (int)levels.size() - 2; i >= 1; i--)
+    {
+        int64 start = getTickCount();
+        variant.run(levels[i + 1], levels[i], out);
+        if (levelMs)
+            levelMs->push_back(Milliseconds(getTickCount() - start));
+    }
+
+    if (variant.outputType == CV_8UC3)
+        return out;
+    Mat encoded(size, CV_8UC3, Scalar::all(0));
+    if (variant.outputType == CV_8UC1)
+        UnpackDirectionMap(out, size.width, encoded); // sector directions, so not comparable bit for bit
+    else
+        EncodeDirectionField(out, encoded);
+    return encoded;
+}
+
+static vector<Mat> ToBgr(const vector<Mat>& levels)
+{
+    vector<Mat> result;
+    for (const Mat& level : levels)
+    {
+        Mat bgr = level;
+        if (level.channels() == 1)
+            cvtColor(level, bgr, COLOR_GRAY2BGR);
+        result.push_back(bgr);
+    }
+    return result;
+}
+
+static json BenchmarkLevels(const string& source, const vector<Mat>& grayOrBgrLevels)
+{
+    Size size = grayOrBgrLevels[0].size();
+    double megapixels = size.area() / 1e6;
+    int top = (int)grayOrBgrLevels.size() - 1;
+    vector<Mat> bgrLevels;
+
+    json result = { { "source", source }, { "width", size.width }, { "height", size.height }, { "channels", grayOrBgrLevels[0].channels() },
+        { "levels", grayOrBgrLevels.size() }, { "variants", json::array() } };
+
+    for (const KernelVariant& variant : kernelVariants)
+    {
+        if (variant.bgrOnly && bgrLevels.empty())
+            bgrLevels = ToBgr(grayOrBgrLevels);
+        const vector<Mat>& levels = variant.bgrOnly ? bgrLevels : grayOrBgrLevels;
+
+        // one pair, the first one the loop runs
+        Mat out = MakeOutput(variant, size);
+        variant.run(levels[top], levels[top - 1], out); // warm up (thread pool, tables)
+        double pairMs = MedianMs([&]() { variant.run(levels[top], levels[top - 1], out); });
+
+        // full loop, per level timings of the median run
+        vector<vector<double>> runs;
+        vector<double> loopMs;
+        for (int r = 0; r < repeats; r++)
+        {
+            vector<double> levelMs;
+            RunLevelLoop(variant, levels, &levelMs);
+            loopMs.push_back(accumulate(levelMs.begin(), levelMs.end(), 0.0));
+            runs.push_back(levelMs);
+        }
+        vector<double> sorted = loopMs;
+        sort(sorted.begin(), sorted.end());
+        int median = (int)(find(loopMs.begin(), loopMs.end(), sorted[sorted.size() / 2]) - loopMs.begin());
+
+        result["variants"].push_back({ { "name", variant.name }, { "pair_ms", pairMs }, { "mpix_per_s", megapixels / (pairMs / 1000.0) },
+            { "ns_per_pixel", pairMs * 1e6 / size.area() },
+            { "output_bytes", out.total() * out.elemSize() }, { "loop_ms", loopMs[median] }, { "level_ms", runs[median] } });
+
+        cout << source << " " << size.width << "x" << size.height << " " << grayOrBgrLevels.size() << " levels, " << variant.name
+            << ": " << pairMs << " ms/pair, " << megapixels / (pairMs / 1000.0) << " Mpix/s, loop " << loopMs[median] << " ms" << endl;
+    }
+    return result;
+}
+
+static json BenchmarkPyramid(Size size, int channels, int levelCount)
+{
+    Mat frame = MakeSyntheticFrame(size, channels);
+    json result = { { "width", size.width }, { "height", size.height }, { "channels", channels }, { "levels", levelCount } };
+    const pair<const char*, AutofocusPyramid::BlurMode> modes[] = { { "gaussian_ms", AutofocusPyramid::Gaussian }, { "box_ms", AutofocusPyramid::BoxApproximation } };
+    for (const auto& mode : modes)
+    {
+        AutofocusPyramid pyramid(AutofocusPyramid::linearSigmas(levelCount, 8.0f / (levelCount - 1)), mode.second);
+        pyramid.build(frame);
+        result[mode.first] = MedianMs([&]() { pyramid.build(frame); });
+    }
+    return result;
+}
+
+// agreement of two CV_8UC3 direction maps, like ReportDirectionMapDifference in autofocus_clean.cpp
+static json DirectionMapAgreement(const Mat& result, const Mat& expected)
+{
+    long long identical = 0, activityMismatch = 0, bothActive = 0;
+    double angleErrorSum = 0.0, angleErrorMax = 0.0;
+    for (int y = 1; y < result.rows - 1; y++)
+    {
+        for (int x = 1; x < result.cols - 1; x++)
+        {
+            const Vec3b& a = result.at<Vec3b>(y, x);
+            const Vec3b& b = expected.at<Vec3b>(y, x);
+            identical += a[0] == b[0] && a[1] == b[1] ? 1 : 0;
+
+            bool activeA = a[0] != 127 || a[1] != 127;
+            bool activeB = b[0] != 127 || b[1] != 127;
+            if (activeA != activeB)
+            {
+                activityMismatch++;
+                continue;
+            }
+            if (!activeA)
+                continue;
+
+            bothActive++;
+            double error = abs(atan2(a[1] - 127.5, a[0] - 127.5) - atan2(b[1] - 127.5, b[0] - 127.5));
+            if (error > CV_PI)
+                error = 2.0 * CV_PI - error;
+            error *= 180.0 / CV_PI;
+            angleErrorSum += error;
+            angleErrorMax = max(angleErrorMax, error);
+        }
+    }
+
+    double pixels = (double)(result.rows - 2) * (result.cols - 2);
+    return { { "identical_percent", 100.0 * identical / pixels }, { "activity_mismatch_percent", 100.0 * activityMismatch / pixels },
+        { "both_active_percent", 100.0 * bothActive / pixels }, { "mean_angle_error_deg", bothActive ? angleErrorSum / bothActive : 0.0 },
+        { "max_angle_error_deg", angleErrorMax } };
+}
+
+// whole engines from a raw frame, the discrete gaussian one is the baseline the others are compared to
+static json CompareEngines(const string& source, const Mat& frame)
+{
+    struct EngineCase { const char* name; Autofocus::Engine engine; AutofocusPyramid::BlurMode blurMode; };
+    const EngineCase engines[] =
+    {
+        { "discrete_gaussian", Autofocus::DiscreteLevels, AutofocusPyramid::Gaussian },
+        { "discrete_box", Autofocus::DiscreteLevels, AutofocusPyramid::BoxApproximation },
+        { "analytic", Autofocus::AnalyticDerivatives, AutofocusPyramid::Gaussian },
+    };
+
+    json result = { { "source", source }, { "width", frame.cols }, { "height", frame.rows }, { "engines", json::array() } };
+    Mat baseline;
+    for (const EngineCase& engine : engines)
+    {
+        Autofocus::Settings settings;
+        settings.engine = engine.engine;
+        settings.blurMode = engine.blurMode;
+        settings.outputType = CV_8UC3;
+        Autofocus autofocus(settings);
+
+        Mat map;
+        autofocus.process(frame, map); // warm up
+        double ms = MedianMs([&]() { autofocus.process(frame, map); });
+        if (baseline.empty())
+            baseline = map.clone();
+
+        json entry = DirectionMapAgreement(map, baseline);
+        entry["name"] = engine.name;
+        entry["ms"] = ms;
+        entry["mpix_per_s"] = frame.total() / 1e6 / (ms / 1000.0);
+        result["engines"].push_back(entry);
+
+        cout << source << " " << frame.cols << "x" << frame.rows << " engine " << engine.name << ": " << ms << " ms, identical to discrete_gaussian "
+            << entry["identical_percent"].get<double>() << "%, mean angle error " << entry["mean_angle_error_deg"].get<double>() << " deg" << endl;
+    }
+    return result;
+}
+
+// processMask / processRegions against process on the same frame. the frame is cut to a size that is not a multiple of
+// the mask tiles, so the tiles at the right and bottom edge are partial. inside the mask every pixel has to match the full
+// frame run, and the timings show what each mask costs next to the full frame.
+static json BenchmarkRegionModes(const string& source, const Mat& frame)
+{
+    Mat image = frame(Rect(0, 0, frame.cols - (frame.cols % 32 == 0 ? 7 : 0), frame.rows - (frame.rows % 32 == 0 ? 5 : 0)));
+    Autofocus::Settings settings;
+    settings.outputType = CV_8UC3;
+    Autofocus autofocus(settings);
+
+    Mat full;
+    autofocus.process(image, full); // warm up
+    double fullMs = MedianMs([&]() { autofocus.process(image, full); });
+
+    Mat fullMask(image.size(), CV_8UC1, Scalar(255));
+    Mat disc = Mat::zeros(image.size(), CV_8UC1);
+    circle(disc, Point(image.cols / 2, image.rows / 2), min(image.cols, image.rows) / 4, Scalar(255), FILLED);
+    Mat corner = Mat::zeros(image.size(), CV_8UC1);
+    corner(Rect(image.cols * 3 / 4, image.rows * 3 / 4, image.cols - image.cols * 3 / 4, image.rows - image.rows * 3 / 4)).setTo(Scalar(255));
+    Mat scattered = Mat::zeros(image.size(), CV_8UC1);
+    vector<Rect> boxes;
+    for (int i = 0; i < 6; i++)
+    {
+        boxes.push_back(Rect(image.cols * (1 + 2 * (i % 3)) / 7, image.rows * (1 + 3 * (i / 3)) / 6, image.cols / 12, image.rows / 10));
+        scattered(boxes.back()).setTo(Scalar(255));
+    }
+    const pair<const char*, const Mat*> masks[] = { { "full", &fullMask }, { "disc", &disc }, { "corner", &corner }, { "boxes", &scattered } };
+
+    json result = { { "source", source }, { "width", image.cols }, { "height", image.rows }, { "full_frame_ms", fullMs }, { "identical", true }, { "modes", json::array() } };
+    auto check = [&](const string& name, const Mat& map, const Mat& mask, double ms)
+    {
+        long long mismatches = 0;
+        for (int y = 0; y < map.rows; y++)
+            for (int x = 0; x < map.cols; x++)
+                mismatches += mask.at<uchar>(y, x) && map.at<Vec3b>(y, x) != full.at<Vec3b>(y, x) ? 1 : 0;
+        result["identical"] = result["identical"].get<bool>() && mismatches == 0;
+        result["modes"].push_back({ { "name", name }, { "ms", ms }, { "cost_vs_full_frame", ms / fullMs }, { "mismatched_pixels", mismatches } });
+        cout << source << " " << image.cols << "x" << image.rows << " " << name << ": " << ms << " ms against " << fullMs << " ms full frame ("
+            << ms / fullMs << "x), mismatched pixels " << mismatches << (mismatches ? "  FAILED" : "") << endl;
+    };
+
+    for (const auto& mask : masks)
+    {
+        Mat map;
+        autofocus.processMask(image, *mask.second, map);
+        double ms = MedianMs([&]() { autofocus.processMask(image, *mask.second, map); });
+        check(string("mask_") + mask.first, map, *mask.second, ms);
+    }
+    Mat map;
+    autofocus.processRegions(image, boxes, map);
+    double ms = MedianMs([&]() { autofocus.processRegions(image, boxes, map); });
+    check("regions_boxes", map, scattered, ms);
+    return result;
+}
+
+// the last level pair into the magnitude field, then ExtractImpulses. the dense scan is what the impulse consumers do
+// today (column by column over every pixel with at<>), the impulse walk is the same visit over the extracted list.
+static json BenchmarkImpulses(const string& source, const vector<Mat>& levels)
+{
+    Size size = levels[0].size();
+    Mat field(size, CV_32FC3, Scalar::all(0));
+    DirectionImpulses impulses;
+    GetStimuli(levels[2], levels[1], field); // warm up
+    ExtractImpulses(field, 0.0f, impulses);
+
+    double fieldMs = MedianMs([&]() { GetStimuli(levels[2], levels[1], field); });
+    double extractMs = MedianMs([&]() { ExtractImpulses(field, 0.0f, impulses); });
+
+    volatile float sink = 0.0f;
+    double denseScanMs = MedianMs([&]()
+    {
+        float sum = 0.0f;
+        for (int x = 0; x < size.width; x++)
+            for (int y = 0; y < size.height; y++)
+                if (field.at<Vec3f>(y, x)[2] > 0.0f)
+                    sum += field.at<Vec3f>(y, x)[2];
+        sink = sum;
+    });
+    double impulseWalkMs = MedianMs([&]()
+    {
+        float sum = 0.0f;
+        for (int x = 0; x < size.width; x++)
+            for (const DirectionImpulse* impulse = impulses.columnBegin(x); impulse != impulses.columnEnd(x); impulse++)
+                sum += impulse->magnitude;
+        sink = sum;
+    });
+
+    cout << source << " " << size.width << "x" << size.height << " impulses: " << impulses.impulses.size() << ", field " << fieldMs
+        << " ms, extract " << extractMs << " ms, dense scan " << denseScanMs << " ms, impulse walk " << impulseWalkMs << " ms" << endl;
+    return { { "source", source }, { "width", size.width }, { "height", size.height }, { "impulses", impulses.impulses.size() },
+        { "field_ms", fieldMs }, { "extract_ms", extractMs }, { "dense_scan_ms", denseScanMs }, { "impulse_walk_ms", impulseWalkMs } };
+}
+
+// applyImpulseField as autofocus.cpp had it before EnergyField, one impulse per call. the baseline for BenchmarkEnergy.
+static void ApplyImpulseFieldPerCall(Mat& field, const EnergyImpulse& impulse)
+{
+    int minX = max(0, int(impulse.center.x - impulse.radius));
+    int maxX = min(field.cols - 1, int(impulse.center.x + impulse.radius));
+    int minY = max(0, int(impulse.center.y - impulse.radius));
+    int maxY = min(field.rows - 1, int(impulse.center.y + impulse.radius));
+    float r2 = impulse.radius * impulse.radius;
+
+    for (int y = minY; y <= maxY; ++y)
+    {
+        for (int x = minX; x <= maxX; ++x)
+        {
+            float dx = x - impulse.center.x;
+            float dy = y - impulse.center.y;
+            float dist2 = dx * dx + dy * dy;
+            if (dist2 > r2)
+                continue;
+
+            float scale = max(0.0f, 1.0f - sqrt(dist2) / impulse.radius);
+            float& pixel = field.at<float>(y, x);
+            float movedEnergy = min(pixel, impulse.strength * scale);
+            if (movedEnergy <= 0.0f)
+                continue;
+            pixel -= movedEnergy;
+
+            int tx = int(round(x + impulse.direction.x * impulse.travelDistance));
+            int ty = int(round(y + impulse.direction.y * impulse.travelDistance));
+            if (tx >= 0 && tx < field.cols && ty >= 0 && ty < field.rows)
+                field.at<float>(ty, tx) += movedEnergy;
+        }
+    }
+}
+
+// one energy transport step for every impulse ExtractImpulses finds, per call vs EnergyField on 1 thread and on all
+static json BenchmarkEnergy(const string& source, const vector<Mat>& levels)
+{
+    Size size = levels[0].size();
+    Mat field(size, CV_32FC3, Scalar::all(0));
+    DirectionImpulses directionImpulses;
+    GetStimuli(levels[2], levels[1], field);
+    ExtractImpulses(field, 0.0f, directionImpulses);
+    vector<EnergyImpulse> impulses;
+    AppendEnergyImpulses(directionImpulses, 5.0f, 20.0f, 5.0f, impulses);
+
+    Mat initial(size, CV_32FC1, Scalar::all(100.0f));
+    Mat perCall;
+    double perCallMs = MedianMs([&]()
+    {
+        initial.copyTo(perCall);
+        for (const EnergyImpulse& impulse : impulses)
+            ApplyImpulseFieldPerCall(perCall, impulse);
+    });
+
+    EnergyField energy(size);
+    auto runStep = [&]()
+    {
+        energy.reset(initial);
+        energy.step(impulses);
+    };
+    int threads = getNumThreads();
+    setNumThreads(1);
+    runStep(); // builds the discs
+    double batchedMs = MedianMs(runStep);
+    setNumThreads(threads);
+    double parallelMs = MedianMs(runStep);
+
+    cout << source << " " << size.width << "x" << size.height << " energy, " << impulses.size() << " impulses: per call " << perCallMs
+        << " ms, batched " << batchedMs << " ms, batched parallel " << parallelMs << " ms" << endl;
+    return { { "source", source }, { "width", size.width }, { "height", size.height }, { "impulses", impulses.size() },
+        { "per_call_ms", perCallMs }, { "batched_ms", batchedMs }, { "batched_parallel_ms", parallelMs } };
+}
+
+// propagateIfOppositeMulti called at every pixel vs the whole field operator, serial and on row bands. both have to
+// give the same gray bit for bit.
+static json BenchmarkPropagate(const string& source, const vector<Mat>& levels)
+{
+    Size size = levels[0].size();
+    Mat field(size, CV_32FC2, Scalar::all(0));
+    GetStimuli(levels[2], levels[1], field);
+
+    Mat perPixel, wholeField, parallelField;
+    double perPixelMs = MedianMs([&]()
+    {
+        perPixel = Mat::zeros(size, CV_32F);
+        for (int y = 0; y < size.height; y++)
+            for (int x = 0; x < size.width; x++)
+            {
+                const Vec2f& dir = field.at<Vec2f>(y, x);
+                propagateIfOppositeMulti(Point(x, y), Point2f(dir[0], dir[1]), field, perPixel, 4, 30.0f);
+            }
+    });
+    double wholeFieldMs = MedianMs([&]()
+    {
+        wholeField = Mat::zeros(size, CV_32F);
+        PropagateIfOpposite(field, wholeField, 4, 30.0f);
+    });
+    double parallelMs = MedianMs([&]()
+    {
+        parallelField = Mat::zeros(size, CV_32F);
+        PropagateIfOppositeParallel(field, parallelField, 4, 30.0f);
+    });
+    bool identical = norm(wholeField, perPixel, NORM_INF) == 0.0 && norm(parallelField, perPixel, NORM_INF) == 0.0;
+
+    cout << source << " " << size.width << "x" << size.height << " propagate: per pixel " << perPixelMs << " ms, whole field "
+        << wholeFieldMs << " ms, parallel " << parallelMs << " ms" << (identical ? "" : ", MISMATCH") << endl;
+    return { { "source", source }, { "width", size.width }, { "height", size.height }, { "per_pixel_ms", perPixelMs },
+        { "whole_field_ms", wholeFieldMs }, { "parallel_ms", parallelMs }, { "identical", identical } };
+}
+
+// returns false if an exact variant does not reproduce the committed result
+static bool CheckCommittedResult(const string& source, const vector<Mat>& realLevels, json& report)
+{
+    Mat expected = imread("autofocusresult.png");
+    if (expected.empty() || realLevels.empty())
+    {
+        cout << "autofocusresult.png or the test levels are missing, regression check skipped" << endl;
+        return true;
+    }
+
+    bool passed = true;
+    vector<Mat> bgrLevels = ToBgr(realLevels);
+    for (const KernelVariant& variant : kernelVariants)
+    {
+        Mat out = RunLevelLoop(variant, variant.bgrOnly ? bgrLevels : realLevels, nullptr);
+        double maxDifference = norm(out, expected, NORM_INF);
+        long long identicalPixels = 0;
+        for (int y = 0; y < out.rows; y++)
+            for (int x = 0; x < out.cols; x++)
+                identicalPixels += out.at<Vec3b>(y, x) == expected.at<Vec3b>(y, x) ? 1 : 0;
+        double identical = 100.0 * identicalPixels / out.total();
+        bool ok = !variant.exact || maxDifference == 0.0;
+        passed = passed && ok;
+
+        report.push_back({ { "source", source }, { "name", variant.name }, { "exact", variant.exact }, { "max_difference", maxDifference }, { "identical_percent", identical }, { "passed", ok } });
+        cout << "regression " << source << " " << variant.name << ": max difference " << maxDifference << ", identical " << identical << "%" << (ok ? "" : "  FAILED") << endl;
+    }
+    return passed;
+}
+
+int main()
+{
+    json report = { { "threads", getNumThreads() }, { "cases", json::array() }, { "pyramid", json::array() }, { "engines", json::array() }, { "impulses", json::array() }, { "energy", json::array() }, { "propagate", json::array() },
+        { "regions", json::array() }, { "regression", json::array() } };
+
+    vector<Mat> realLevels = ReadRealLevels(IMREAD_COLOR);
+    vector<Mat> realGrayLevels = ReadRealLevels(IMREAD_GRAYSCALE);
+    bool passed = CheckCommittedResult("real", realLevels, report["regression"]);
+    passed = CheckCommittedResult("real_gray", realGrayLevels, report["regression"]) && passed;
+
+    for (const Size& resolution : resolutions)
+    {
+        const pair<const char*, const vector<Mat>*> realSets[] = { { "real", &realLevels }, { "real_gray", &realGrayLevels } };
+        for (const auto& realSet : realSets)
+        {
+            if (realSet.second->empty())
+                continue;
+            vector<Mat> levels = *realSet.second;
+            if (resolution.area() > 0)
+                for (Mat& level : levels)
+                    resize(level, level, resolution, 0, 0, INTER_LINEAR);
+            report["cases"].push_back(BenchmarkLevels(realSet.first, levels));
+            report["impulses"].push_back(BenchmarkImpulses(realSet.first, levels));
+            report["energy"].push_back(BenchmarkEnergy(realSet.first, levels));
+            json propagate = BenchmarkPropagate(realSet.first, levels);
+            passed = passed && propagate["identical"].get<bool>();
+            report["propagate"].push_back(propagate);
+        }
+
+        if (!realLevels.empty())
+        {
+            Mat frame = realLevels[0];
+            if (resolution.area() > 0)
+                resize(frame, frame, resolution, 0, 0, INTER_LINEAR);
+            report["engines"].push_back(CompareEngines("real", frame));
+            json regions = BenchmarkRegionModes("real", frame);
+            passed = passed && regions["identical"].get<bool>();
+            report["regions"].push_back(regions);
+        }
+
+        Size size = resolution.area() > 0 ? resolution : (realLevels.empty() ? Size(400, 400) : realLevels[0].size());
+        for (int channels : { 1, 3 })
+        {
+            for (int levelCount : syntheticLevelCounts)
+            {
+                AutofocusPyramid pyramid(AutofocusPyramid::linearSigmas(levelCount, 8.0f / (levelCount - 1)));
+                pyramid.build(MakeSyntheticFrame(size, channels));
+                vector<Mat> levels;
+                for (int i = 0; i < levelCount; i++)
+                    levels.push_back(pyramid.getLevel(i));
+                report["cases"].push_back(BenchmarkLevels(channels == 1 ? "synthetic_gray" : "synthetic_bgr", levels));
+                report["pyramid"].push_back(BenchmarkPyramid(size, channels, levelCount));
+            }
+        }
+    }
+
+    report["regression_passed"] = passed;
+    ofstream file(benchmarkJson);
+    file << report.dump(4);
+    cout << "results written to " << benchmarkJson << endl;
+
+    return passed ? 0 : 1;
+}
@@ -1,6 +1,11 @@
 ﻿#include <opencv2/opencv.hpp>
 #include <iostream>
 #include <utility>
+#include "AutofocusPyramid.h"
+#include "AutofocusKernels.h"
+#include "AutofocusFixedPoint.h"
+#include "AutofocusImpulses.h"
+#include "AutofocusCommon.h"
 
 using namespace std;
 using namespace cv;
@@ -8,85 +13,225 @@ using namespace cv;
 // initial autofocus.cpp file was dirty, and potentially, not working due to experimentation with the algorithm.
 // here is a clean version of the autofıcus algorithm, there are certainly some room for improvement, but i think 
 // it's fine for now.
+// the kernel itself now lives in AutofocusKernels.cpp so the other autofocus entry points can share it.
 
-vector<Point> directions = { {-1, 0}, {-1, -1}, {0, -1}, {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 1} };
-vector<Point2f> directionsF = 
+// times GetStimuliParallel from 1 to all cores on a 400x400 level pair and the same pair upscaled to 1080p and 4k.
+// every run is also checked against the serial output.
+void ReportParallelScaling(const Mat& prev, const Mat& curr)
 {
-    { -1.0f,  0.0f }, // left
-    { -0.7071f, -0.7071f }, // up-left
-    {  0.0f, -1.0f }, // up
-    {  0.7071f, -0.7071f }, // up-right
-    {  1.0f,  0.0f }, // right
-    {  0.7071f,  0.7071f }, // down-right
-    {  0.0f,  1.0f }, // down
-    { -0.7071f,  0.7071f } // down-left
-};
-
-inline float similarityL1(const Vec3b& a, const Vec3b& b) // l1 similarity for memory 
-{
-    int diff =
-        abs(a[0] - b[0]) +
-        abs(a[1] - b[1]) +
-        abs(a[2] - b[2]);
+    const Size resolutions[] = { Size(400, 400), Size(1920, 1080), Size(3840, 2160) };
+    const int repeats = 10;
+    int maxThreads = getNumberOfCPUs();
 
-    return 1.0f - (diff / 765.0f);
-}
+    for (const Size& resolution : resolutions)
+    {
+        Mat p, c;
+        resize(prev, p, resolution, 0, 0, INTER_LINEAR);
+        resize(curr, c, resolution, 0, 0, INTER_LINEAR);
+        Mat serial(resolution, CV_8UC3, Scalar(0, 0, 0));
+        GetStimuli(p, c, serial);
 
-inline Point2f normalize(const Point2f& v) // simple normalizing function, also prunes weak signals
-{
-    float length = sqrt(v.x * v.x + v.y * v.y);
+        double singleThreadMs = 0.0;
+        for (int threads = 1; threads <= maxThreads; threads++)
+        {
+            setNumThreads(threads);
+            Mat parallel(resolution, CV_8UC3, Scalar(0, 0, 0));
+            GetStimuliParallel(p, c, parallel); // warm up the pool
 
-    if (length < 0.1f)
-        return Point2f(0.0f, 0.0f);
+            int64 start = getTickCount();
+            for (int r = 0; r < repeats; r++)
+                GetStimuliParallel(p, c, parallel);
+            double ms = (getTickCount() - start) * 1000.0 / getTickFrequency() / repeats;
+            if (threads == 1)
+                singleThreadMs = ms;
 
-    return Point2f(v.x / length, v.y / length);
+            cout << resolution.width << "x" << resolution.height << " threads " << threads << ": " << ms << " ms, speedup "
+                << singleThreadMs / ms << (norm(serial, parallel, NORM_INF) == 0 ? "" : "  MISMATCH") << endl;
+        }
+    }
+    setNumThreads(-1);
 }
 
-inline float mapFloatSafe(float value, float inMin, float inMax, float outMin, float outMax)
+// speed / fidelity report for the approximate blur modes. compares two direction maps written by GetStimuli, decoding
+// the first two channels back to a direction (127, 127 is a pruned pixel).
+void ReportDirectionMapDifference(const Mat& result, const Mat& expected)
 {
-    if (inMax - inMin == 0.0f)
-        return outMin; 
-
-    return outMin + (value - inMin) * (outMax - outMin) / (inMax - inMin);
-}
+    CV_Assert(result.type() == CV_8UC3 && expected.type() == CV_8UC3 && result.size() == expected.size());
 
-void GetStimuli(Mat& prev, Mat& curr, Mat& out) // core algorithm of autofocus concept
-{
-    for (int i = 1; i < prev.cols - 1; i++)
+    int identical = 0, activityMismatch = 0, bothActive = 0;
+    double angleErrorSum = 0.0, angleErrorMax = 0.0;
+    for (int y = 0; y < result.rows; y++)
     {
-        for (int j = 1; j < prev.rows - 1; j++)
+        const Vec3b* a = result.ptr<Vec3b>(y);
+        const Vec3b* b = expected.ptr<Vec3b>(y);
+        for (int x = 0; x < result.cols; x++)
         {
-            Point2f dir(0.0f, 0.0f);
-            Vec3b& ownValue = prev.at<Vec3b>(j, i); // save previous value at pixel
-            for (int k = 0; k < 8; k++) // compare to current values of neighbors to detect motion
+            if (a[x][0] == b[x][0] && a[x][1] == b[x][1])
+                identical++;
+
+            bool activeA = a[x][0] != 127 || a[x][1] != 127;
+            bool activeB = b[x][0] != 127 || b[x][1] != 127;
+            if (activeA != activeB)
             {
-                Vec3b& testValue = curr.at<Vec3b>(j + directions[k].y, i + directions[k].x);
-                float similarity = similarityL1(ownValue, testValue);
-                dir += directionsF[k] * similarity; // similar neighbor means point of interest shifted towards here.
+                activityMismatch++;
+                continue;
             }
-            dir = normalize(dir);
-            out.at<Vec3b>(j, i) = Vec3b((int)mapFloatSafe(dir.x, -1.0f, 1.0f, 0.0f, 255.0f), (int)mapFloatSafe(dir.y, -1.0f, 1.0f, 0.0f, 255.0f), 127);
+            if (!activeA)
+                continue;
+
+            bothActive++;
+            double angleA = atan2(a[x][1] - 127.5, a[x][0] - 127.5);
+            double angleB = atan2(b[x][1] - 127.5, b[x][0] - 127.5);
+            double error = abs(angleA - angleB);
+            if (error > CV_PI)
+                error = 2.0 * CV_PI - error;
+            error *= 180.0 / CV_PI;
+            angleErrorSum += error;
+            angleErrorMax = max(angleErrorMax, error);
         }
     }
+
+    double pixels = (double)result.total();
+    cout << "identical pixels: " << 100.0 * identical / pixels << "%" << endl;
+    cout << "active / pruned mismatch: " << 100.0 * activityMismatch / pixels << "%" << endl;
+    cout << "angle error on pixels active in both (deg): mean " << (bothActive ? angleErrorSum / bothActive : 0.0) << ", max " << angleErrorMax << endl;
 }
 
+const bool verifyAgainstReference = false; // runs the original per pixel kernel next to the fast one and reports mismatches
+const bool blurInProcess = false; // build the blur levels from one raw frame instead of reading autofocustest1/1..8.png
+const AutofocusPyramid::BlurMode blurMode = AutofocusPyramid::Gaussian; // BoxApproximation trades fidelity for constant cost per level
+const bool reportAgainstCommittedResult = false; // compares the final map to the committed autofocusresult.png instead of overwriting it
+const int stimuliThreads = 0; // GetStimuli thread pool size, 0 keeps opencv's default (all cores), 1 runs serial
+const bool reportParallelScaling = false; // prints 1..N core timings at 400x400, 1080p and 4k before the normal run
+const bool outputFloatField = false; // GetStimuli writes a CV_32FC2 field, the 8 bit map is only made for display / saving
+const int sparseEpsilon = -1; // 0 or more only runs the kernel where the 3x3 window changed by more than this between levels
+const bool fixedPoint = false; // integer only kernel (AutofocusFixedPoint.h), 8 bit output only
+const bool reportFixedPointError = false; // prints the measured fixed point vs float error for every level pair
+const double convergenceThreshold = 0.0; // above 0, stops descending once less than this fraction of pixels changed direction in a pass
+const bool extractImpulses = false; // reruns the last pair with magnitudes and shows the impulses left after non maximum suppression
+const StimuliStencil stencil = Stencil8; // neighborhood of the dense kernels, the rings catch more motion per level but are not the reference
+
 int main()
 {
-    Mat previous = imread("autofocustest1/8.png"); // read blurred versions of image -- in production, gaussian blurs can be calculated at real time
+    AutofocusPyramid pyramid(AutofocusPyramid::linearSigmas(9, 1.0f), blurMode);
+    if (blurInProcess)
+    {
+        Mat frame = imread("autofocustest1/0.png", IMREAD_GRAYSCALE); // any camera frame can go here, read as gray like the levels
+        int64 start = getTickCount();
+        pyramid.build(frame);
+        cout << "pyramid build: " << (getTickCount() - start) * 1000.0 / getTickFrequency() << " ms" << endl;
+    }
+
+    // the test set is gray content stored as 3 channel pngs. read as gray it runs through the single channel kernel,
+    // which gives the same result as the bgr one for equal channels at a third of the loads
+    auto readLevel = [&](int level) { return blurInProcess ? pyramid.getLevel(level) : imread("autofocustest1/" + to_string(level) + ".png", IMREAD_GRAYSCALE); };
+
+    Mat previous = readLevel(8); // read blurred versions of image
+    if (reportParallelScaling)
+        ReportParallelScaling(previous, readLevel(7));
+    if (stimuliThreads > 0)
+        setNumThreads(stimuliThreads);
+
     Mat out(previous.rows, previous.cols, CV_8UC3, Scalar(0, 0, 0));
+    Mat field(previous.rows, previous.cols, CV_32FC2, Scalar(0, 0));
+    Mat referenceOut = out.clone();
+    if (sparseEpsilon >= 0)
+    {
+        ClearDirectionMap(out); // sparse never writes pixels whose window did not change
+        ClearDirectionMap(field);
+    }
+    StimuliActiveRuns activeRuns;
+    Mat directionCodes(previous.rows, previous.cols, CV_8UC1, Scalar(0));
+    int passes = 0, stopLevel = 1;
     for (int i = 7; i >= 1; i--)
     {
-        Mat current = imread("autofocustest1/" + to_string(i) + ".png");
-        GetStimuli(previous, current, out);
+        Mat current = readLevel(i);
+        Mat& target = outputFloatField ? field : out;
+        if (reportFixedPointError)
+        {
+            FixedPointError error = MeasureFixedPointError(previous, current);
+            cout << "level " << i << " fixed point: max byte error " << error.maxByteError << ", mean " << error.meanByteError
+                << ", pruning mismatches " << 100.0 * error.pruneMismatches / error.comparedPixels << "%" << endl;
+        }
+
+        if (fixedPoint)
+        {
+            if (stimuliThreads == 1)
+                GetStimuliFixedPoint(previous, current, out);
+            else
+                GetStimuliFixedPointParallel(previous, current, out);
+        }
+        else if (sparseEpsilon >= 0)
+        {
+            BuildStimuliActiveRuns(previous, current, sparseEpsilon, activeRuns);
+            GetStimuliSparse(previous, current, target, activeRuns);
+            cout << "level " << i << " active pixels: " << 100.0 * activeRuns.activePixels / previous.total() << "%" << endl;
+        }
+        else if (stimuliThreads == 1)
+            GetStimuli(previous, current, target, stencil);
+        else
+            GetStimuliParallel(previous, current, target, 32, stencil);
+        if (outputFloatField && !fixedPoint)
+            EncodeDirectionField(field, out); // visual post-pass
+        if (verifyAgainstReference)
+        {
+            Mat previousBgr = previous, currentBgr = current; // the reference only takes bgr
+            if (previous.channels() == 1)
+            {
+                cvtColor(previous, previousBgr, COLOR_GRAY2BGR);
+                cvtColor(current, currentBgr, COLOR_GRAY2BGR);
+            }
+            GetStimuliReference(previousBgr, currentBgr, referenceOut);
+            cout << "level " << i << " max difference to reference: " << norm(out, referenceOut, NORM_INF) << endl;
+        }
         imshow("out", out);
         waitKey(0); // visual debug
         previous = current;
+
+        passes++;
+        if (convergenceThreshold > 0.0)
+        {
+            // levels below this one are not even read
+            double changed = UpdateDirectionCodes(outputFloatField && !fixedPoint ? field : out, directionCodes);
+            cout << "level " << i << " direction changes: " << 100.0 * changed << "%" << endl;
+            if (passes >= 2 && changed < convergenceThreshold)
+            {
+                stopLevel = i;
+                break;
+            }
+        }
+    }
+    if (convergenceThreshold > 0.0)
+        cout << "stopped at level " << stopLevel << endl;
+
+    if (extractImpulses)
+    {
+        Mat magnitudeField(previous.size(), CV_32FC3, Scalar::all(0));
+        GetStimuli(readLevel(stopLevel + 1), previous, magnitudeField, stencil);
+
+        DirectionImpulses impulses;
+        int64 start = getTickCount();
+        ExtractImpulses(magnitudeField, 0.0f, impulses);
+        cout << "impulses: " << impulses.impulses.size() << " in " << (getTickCount() - start) * 1000.0 / getTickFrequency() << " ms" << endl;
+
+        Mat impulseMap(previous.size(), CV_8UC3, Scalar(0, 0, 0));
+        for (const DirectionImpulse& impulse : impulses.impulses)
+        {
+            int bx = (int)mapFloatSafe(impulse.direction.x, -1.0f, 1.0f, 0.0f, 255.0f);
+            int gy = (int)mapFloatSafe(impulse.direction.y, -1.0f, 1.0f, 0.0f, 255.0f);
+            impulseMap.at<Vec3b>(impulse.y, impulse.x) = Vec3b(bx, gy, 255);
+        }
+        imshow("impulses", impulseMap);
+        waitKey(0);
     }
 
     imshow("Direction Map (GB)", out);
     waitKey(0);
 
-    imwrite("autofocusresult.png", out);
+    if (reportAgainstCommittedResult)
+        ReportDirectionMapDifference(out, imread("autofocusresult.png"));
+    else
+        imwrite("autofocusresult.png", out);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <atomic>
+#include "AutofocusStream.h"
+#include "AutofocusTileReuse.h"
+
+using namespace std;
+using namespace cv;
+
+// live version of autofocus_clean.cpp. reads a camera (or a video file), runs the autofocus levels for every frame
+// on a pipelined stream and prints the sustained frame rate at the end. press any key in the window to stop.
+
+const int cameraIndex = 0;
+const string videoFile = ""; // set to read a file instead of the camera
+const int levelCount = 9;
+const float sigmaStep = 1.0f;
+const AutofocusPyramid::BlurMode blurMode = AutofocusPyramid::BoxApproximation; // lets the level passes start before the pyramid is done
+const bool showOutput = true;
+const bool tileReuse = false; // static camera mode, only recomputes the tiles that changed (serial, no pipelining)
+const int reuseTileSize = 64;
+const double reuseChangeThreshold = 0.0; // per tile sum of absolute differences that still counts as unchanged
+
+int main()
+{
+    VideoCapture capture;
+    if (videoFile.empty())
+        capture = VideoCapture(cameraIndex);
+    else
+        capture = VideoCapture(videoFile);
+
+    if (!capture.isOpened())
+    {
+        cerr << "could not open video source" << endl;
+        return 1;
+    }
+
+    if (tileReuse)
+    {
+        Autofocus::Settings settings;
+        settings.sigmas = AutofocusPyramid::linearSigmas(levelCount, sigmaStep);
+        settings.blurMode = blurMode;
+        settings.lastLevel = 0; // same levels as the stream
+        settings.outputType = CV_8UC3;
+        AutofocusTileReuse reuse(settings, reuseTileSize, reuseChangeThreshold);
+
+        Mat frame, directionMap;
+        int64 start = getTickCount();
+        long long frames = 0;
+        while (capture.read(frame) && !frame.empty())
+        {
+            AutofocusTileReuse::FrameStats frameStats = reuse.process(frame, directionMap);
+            cout << "frame " << frames++ << ": " << frameStats.changedTiles << " changed, " << frameStats.recomputedTiles << " / " << frameStats.tiles
+                << " recomputed, reuse " << 100.0 * frameStats.reuseRatio << "%" << endl;
+            if (showOutput)
+            {
+                imshow("Direction Map (GB)", directionMap);
+                if (waitKey(1) >= 0)
+                    break;
+            }
+        }
+
+        double seconds = (getTickCount() - start) / getTickFrequency();
+        cout << "frames: " << frames << ", " << frames / seconds << " fps, overall reuse " << 100.0 * reuse.getTotalReusedTiles() / max(1LL, reuse.getTotalTiles()) << "%" << endl;
+        return 0;
+    }
+
+    atomic<bool> stopRequested(false); // set on the display thread, read by the producer
+    AutofocusStream stream(AutofocusPyramid::linearSigmas(levelCount, sigmaStep), blurMode, 3, videoFile.empty());
+
+    AutofocusStream::Stats stats = stream.run(
+        [&](Mat& frame) { return !stopRequested && capture.read(frame) && !frame.empty(); },
+        [&](long long, const Mat& directionMap)
+        {
+            if (showOutput)
+            {
+                imshow("Direction Map (GB)", directionMap);
+                if (waitKey(1) >= 0)
+                    stopRequested = true;
+            }
+        });
+
+    cout << "frames read: " << stats.framesRead << ", processed: " << stats.framesProcessed << ", dropped: " << stats.framesDropped << endl;
+    cout << "sustained: " << stats.fps << " fps over " << stats.seconds << " s" << endl;
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include "AutofocusTiled.h"
+
+using namespace std;
+using namespace cv;
+
+// out of core run for scans that do not fit in memory. reads a headerless raw scan (or a folder of tiles) and writes
+// the direction field as a raw file of the same size, tile by tile. see AutofocusTiled.h.
+
+const string inputRaw = "scan.raw"; // rows * cols * channels bytes, interleaved bgr or gray
+const string inputTilePattern = ""; // set (e.g. "scan/%d_%d.png", row then column) to read tile files instead
+const int inputTileSize = 2048; // size of the input tile files
+const Size imageSize(40000, 30000);
+const int imageType = CV_8UC1;
+const string outputRaw = "scan_directions.raw";
+const string outputTilePattern = ""; // set (e.g. "directions/%d_%d.png") to write one file per output tile instead
+const int tileSize = 1024;
+const AutofocusPyramid::BlurMode blurMode = AutofocusPyramid::BoxApproximation; // smallest halo, see Autofocus::processRegions
+
+int main()
+{
+    Autofocus::Settings settings;
+    settings.blurMode = blurMode;
+    settings.outputType = outputTilePattern.empty() ? CV_32FC2 : CV_8UC3;
+
+    unique_ptr<AutofocusTileSource> source;
+    if (inputTilePattern.empty())
+        source.reset(new MappedRawImage(inputRaw, imageSize, imageType));
+    else
+        source.reset(new TileFileSource(inputTilePattern, imageSize, inputTileSize, imageType));
+
+    unique_ptr<AutofocusTileSink> sink;
+    if (outputTilePattern.empty())
+        sink.reset(new MappedRawImage(outputRaw, imageSize, settings.outputType, true));
+    else
+        sink.reset(new TileFileSink(outputTilePattern, tileSize));
+
+    AutofocusTiled tiled(settings, tileSize);
+    AutofocusTiled::Stats stats = tiled.run(*source, *sink);
+
+    cout << stats.tiles << " tiles of " << tileSize << " px, halo " << stats.halo << " px, read amplification " << stats.readAmplification << endl;
+    cout << stats.seconds << " s, " << (double)imageSize.width * imageSize.height / 1e6 / stats.seconds << " Mpix/s" << endl;
+    return 0;
+}
@@ -0,0 +1,283 @@
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include "json.hpp"
+#include "PatternDatabase.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+// headless benchmark for PatternDatabase::classify, the hot path of the scan-line layers once a database holds
+// thousands of clusters. databases of random patterns in [0,1]^dim are built up to every size in clusterCounts and
+// classify is timed against the scan it replaced (one PatternCluster after another, sqrt per cluster). every query has
+// to give the same index as that scan.
+// the indexed database (k-d tree) is timed against the block scan for doubling cluster counts, its crossover is the
+// first count where it wins. both databases learn the same sequence, where a part of the patterns lands on existing
+// clusters and moves their centroids, and have to agree on every query.
+// classifyBatch is timed with both kernels against classify row by row on the same queries, for the best match and the
+// top batchK. its best matches have to be what classify returns and both kernels have to give the same top batchK.
+// besides the databases above, whose random queries drop most blocks after a few dimensions, it also runs on
+// embedding-like data where every centroid is about as far from a query as the threshold (points on a sphere, queried
+// near its center), so the early exit hardly ever fires. results go to benchmarkJson.
+
+const string benchmarkJson = "pattern_benchmark.json";
+const int repeats = 5; // every timing is the median of this many runs
+const int queryCount = 2000;
+const size_t clusterCounts[] = { 100, 1000, 10000 };
+const size_t dims[] = { 9, 32 }; // 9 is a 5 pixel memory kernel plus a 4 wide embedding, like the scan-line layer
+const float classifyThreshold = 0.25f;
+const size_t indexDims[] = { 5, 9, 32 };
+const size_t maxIndexClusters = 16384; // index section doubles from 16 up to this
+const size_t batchK = 5;
+const float indexThresholdPerDim = 0.04f; // the index section uses this * sqrt(dim), so [0,1]^dim has room for all clusters
+const size_t sphereDims[] = { 128, 256 };
+const size_t spherePoints = 4000;
+const float sphereThreshold = 1.05f; // points of the unit sphere are about sqrt(2) apart and 1 from its center
+
+static double MedianMs(const function<void()>& run)
+{
+    vector<double> times;
+    for (int i = 0; i < repeats; i++)
+    {
+        auto start = chrono::steady_clock::now();
+        run();
+        times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// classify as it was before the centroid blocks
+static int ClassifyPerCluster(const PatternDatabase& database, const vector<float>& pattern, float distanceThreshold)
+{
+    int bestIndex = -1;
+    float bestDist = numeric_limits<float>::max();
+    const vector<PatternCluster>& clusters = database.getClusters();
+    for (size_t i = 0; i < clusters.size(); ++i)
+    {
+        float sum = 0.0f;
+        for (size_t j = 0; j < clusters[i].centroid.size(); ++j)
+        {
+            float d = clusters[i].centroid[j] - pattern[j];
+            sum += d * d;
+        }
+        float dist = sqrt(sum);
+        if (dist < bestDist)
+        {
+            bestDist = dist;
+            bestIndex = static_cast<int>(i);
+        }
+    }
+    return (bestDist <= distanceThreshold) ? bestIndex : -1;
+}
+
+static vector<float> RandomPattern(mt19937& rng, size_t dim)
+{
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    vector<float> pattern(dim);
+    for (float& value : pattern)
+        value = uniform(rng);
+    return pattern;
+}
+
+// half the queries are close to a centroid, half are random and mostly end up as -1
+static vector<vector<float>> MakeQueries(mt19937& rng, const PatternDatabase& database, size_t dim, float threshold)
+{
+    normal_distribution<float> noise(0.0f, threshold / (2.0f * sqrt((float)dim)));
+    uniform_int_distribution<size_t> pick(0, database.size() - 1);
+    vector<vector<float>> queries;
+    for (int i = 0; i < queryCount; i++)
+    {
+        if (i % 2)
+        {
+            queries.push_back(RandomPattern(rng, dim));
+            continue;
+        }
+        vector<float> query = database.getClusters()[pick(rng)].centroid;
+        for (float& value : query)
+            value += noise(rng);
+        queries.push_back(query);
+    }
+    return queries;
+}
+
+// learns clusterCount clusters into both databases. every third pattern is a centroid plus noise within the threshold,
+// so the clusters also get updated while they are learned.
+static void Learn(mt19937& rng, PatternDatabase& scanned, PatternDatabase& indexed, size_t dim, size_t clusterCount, float threshold)
+{
+    uniform_real_distribution<float> nudge(-threshold / (2.0f * sqrt((float)dim)), threshold / (2.0f * sqrt((float)dim)));
+    for (int i = 0; scanned.size() < clusterCount; i++)
+    {
+        vector<float> pattern;
+        if (i % 3 == 2 && scanned.size() > 0)
+        {
+            pattern = scanned.getClusters()[rng() % scanned.size()].centroid;
+            for (float& value : pattern)
+                value += nudge(rng);
+        }
+        else
+            pattern = RandomPattern(rng, dim);
+        scanned.addPattern(pattern);
+        indexed.addPattern(pattern);
+    }
+}
+
+static json BenchmarkIndex(mt19937& rng, size_t dim, bool& passed)
+{
+    float threshold = indexThresholdPerDim * sqrt((float)dim);
+    PatternDatabase scanned(threshold), indexed(threshold, true);
+    json cases = json::array();
+    long long crossover = -1;
+    for (size_t clusterCount = 16; clusterCount <= maxIndexClusters; clusterCount *= 2)
+    {
+        Learn(rng, scanned, indexed, dim, clusterCount, threshold);
+        vector<vector<float>> queries = MakeQueries(rng, scanned, dim, threshold);
+
+        vector<int> expected(queries.size()), actual(queries.size());
+        double scanMs = MedianMs([&]()
+        {
+            for (size_t i = 0; i < queries.size(); i++)
+                expected[i] = scanned.classify(queries[i]);
+        });
+        double indexMs = MedianMs([&]()
+        {
+            for (size_t i = 0; i < queries.size(); i++)
+                actual[i] = indexed.classify(queries[i]);
+        });
+        bool identical = expected == actual && scanned.size() == indexed.size();
+        passed = passed && identical;
+        if (crossover == -1 && indexMs < scanMs)
+            crossover = (long long)scanned.size();
+
+        cout << "dim " << dim << ", " << scanned.size() << " clusters: blocks " << scanMs << " ms, k-d tree " << indexMs << " ms"
+            << (identical ? "" : ", MISMATCH") << endl;
+        cases.push_back({ { "clusters", scanned.size() }, { "queries", queries.size() }, { "blocks_ms", scanMs }, { "kd_tree_ms", indexMs },
+            { "identical", identical } });
+    }
+    cout << "dim " << dim << " crossover: " << (crossover == -1 ? string("none") : to_string(crossover) + " clusters") << endl;
+    return { { "dim", dim }, { "threshold", threshold }, { "crossover_clusters", crossover }, { "cases", cases } };
+}
+
+// expected is what classify returned for every query, rowsMs how long that took
+static json BenchmarkBatch(const string& data, const PatternDatabase& database, const vector<vector<float>>& queries, const vector<int>& expected, double rowsMs,
+    bool& passed)
+{
+    size_t dim = database.getDimension();
+    vector<float> rows;
+    for (const vector<float>& query : queries)
+        rows.insert(rows.end(), query.begin(), query.end());
+
+    json result = { { "data", data }, { "dim", dim }, { "clusters", database.size() }, { "queries", queries.size() }, { "rows_ms", rowsMs }, { "top_k", batchK } };
+    vector<ClusterMatch> tops[2];
+    bool identical = true;
+    const pair<const char*, PatternDatabase::BatchKernel> kernels[] = { { "early_exit", PatternDatabase::EarlyExit }, { "dot_products", PatternDatabase::DotProducts } };
+    cout << data << " dim " << dim << ", " << database.size() << " clusters, " << queries.size() << " queries: rows " << rowsMs << " ms";
+    for (int i = 0; i < 2; i++)
+    {
+        vector<ClusterMatch> best;
+        double batchMs = MedianMs([&]() { database.classifyBatch(rows.data(), queries.size(), best, kernels[i].second); });
+        double topMs = MedianMs([&]() { database.classifyBatch(rows.data(), queries.size(), batchK, tops[i], kernels[i].second); });
+        for (size_t q = 0; q < queries.size(); q++)
+            identical = identical && best[q].cluster == expected[q] && tops[i][q * batchK].cluster == expected[q];
+
+        result[string(kernels[i].first) + "_ms"] = batchMs;
+        result[string(kernels[i].first) + "_top_k_ms"] = topMs;
+        cout << ", " << kernels[i].first << " " << batchMs << " ms (top " << batchK << " " << topMs << " ms)";
+    }
+    for (size_t i = 0; i < tops[0].size(); i++)
+        identical = identical && tops[0][i].cluster == tops[1][i].cluster && tops[0][i].distance == tops[1][i].distance;
+    passed = passed && identical;
+
+    result["identical"] = identical;
+    cout << (identical ? "" : ", MISMATCH") << endl;
+    return result;
+}
+
+// unit vectors as clusters, queries close to the center: every centroid is about 1 away, within the threshold. in
+// these dimensions two random unit vectors are hardly ever within the threshold, so nearly every point is a cluster.
+static json BenchmarkBatchSphere(mt19937& rng, size_t dim, bool& passed)
+{
+    normal_distribution<float> gaussian(0.0f, 1.0f);
+    auto onSphere = [&](float radius)
+    {
+        vector<float> pattern(dim);
+        float norm = 0.0f;
+        for (float& value : pattern)
+        {
+            value = gaussian(rng);
+            norm += value * value;
+        }
+        for (float& value : pattern)
+            value *= radius / sqrt(norm);
+        return pattern;
+    };
+
+    PatternDatabase database(sphereThreshold);
+    for (size_t i = 0; i < spherePoints; i++)
+        database.addPattern(onSphere(1.0f));
+    vector<vector<float>> queries;
+    for (int i = 0; i < queryCount; i++)
+        queries.push_back(onSphere(0.05f));
+
+    vector<int> expected(queries.size());
+    double rowsMs = MedianMs([&]()
+    {
+        for (size_t i = 0; i < queries.size(); i++)
+            expected[i] = database.classify(queries[i]);
+    });
+    return BenchmarkBatch("sphere", database, queries, expected, rowsMs, passed);
+}
+
+int main()
+{
+    json report = { { "classify", json::array() }, { "batch", json::array() }, { "index", json::array() } };
+    bool passed = true;
+    mt19937 rng(1234);
+
+    for (size_t dim : dims)
+    {
+        PatternDatabase database(classifyThreshold);
+        for (size_t clusterCount : clusterCounts)
+        {
+            while (database.size() < clusterCount)
+                database.addPattern(RandomPattern(rng, dim));
+            vector<vector<float>> queries = MakeQueries(rng, database, dim, classifyThreshold);
+
+            vector<int> expected(queries.size()), actual(queries.size());
+            double perClusterMs = MedianMs([&]()
+            {
+                for (size_t i = 0; i < queries.size(); i++)
+                    expected[i] = ClassifyPerCluster(database, queries[i], classifyThreshold);
+            });
+            double blockedMs = MedianMs([&]()
+            {
+                for (size_t i = 0; i < queries.size(); i++)
+                    actual[i] = database.classify(queries[i]);
+            });
+            bool identical = expected == actual;
+            passed = passed && identical;
+            long long matched = count_if(actual.begin(), actual.end(), [](int index) { return index != -1; });
+
+            cout << "dim " << dim << ", " << database.size() << " clusters, " << queries.size() << " queries (" << matched << " matched): per cluster "
+                << perClusterMs << " ms, blocks " << blockedMs << " ms" << (identical ? "" : ", MISMATCH") << endl;
+            report["classify"].push_back({ { "dim", dim }, { "clusters", database.size() }, { "queries", queries.size() }, { "matched", matched },
+                { "per_cluster_ms", perClusterMs }, { "blocks_ms", blockedMs }, { "identical", identical } });
+            report["batch"].push_back(BenchmarkBatch("uniform", database, queries, actual, blockedMs, passed));
+        }
+    }
+    for (size_t dim : sphereDims)
+        report["batch"].push_back(BenchmarkBatchSphere(rng, dim, passed));
+
+    for (size_t dim : indexDims)
+        report["index"].push_back(BenchmarkIndex(rng, dim, passed));
+
+    report["passed"] = passed;
+    ofstream file(benchmarkJson);
+    file << report.dump(4);
+    cout << "results written to " << benchmarkJson << endl;
+
+    return passed ? 0 : 1;
+}